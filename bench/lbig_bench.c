@@ -0,0 +1,81 @@
+/* Compare schoolbook and Karatsuba multiplication of big integers (see
+ * src/lbig.h) on operands of growing size. Run with `make bench-lbig`.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "lbig.h"
+
+/* Minimal time spent on each measurement, in seconds */
+#define BENCH_MIN_TIME 0.2
+
+typedef struct lbig* (*lbig_mul_fn)(const struct lbig*, const struct lbig*);
+
+static struct lbig*
+random_lbig(int count) {
+    struct lbig* a = malloc(sizeof(struct lbig) + count * sizeof(uint32_t));
+    a->negative = false;
+    a->count = count;
+    for (int i = 0; i < count; ++i) {
+        a->limbs[i] = ((uint32_t)rand() << 16) ^ (uint32_t)rand();
+    }
+    if (a->limbs[count - 1] == 0) {
+        a->limbs[count - 1] = 1;
+    }
+    return a;
+}
+
+static double
+now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Average time of one multiplication, in microseconds */
+static double
+time_mul(lbig_mul_fn mul, struct lbig* a, struct lbig* b) {
+    long runs = 0;
+    double start = now();
+    double elapsed;
+    do {
+        lbig_del(mul(a, b));
+        runs++;
+        elapsed = now() - start;
+    } while (elapsed < BENCH_MIN_TIME);
+    return elapsed / runs * 1e6;
+}
+
+int
+main(void) {
+    srand(42);
+    printf("Karatsuba threshold : %d limbs of 32 bits\n\n",
+           LBIG_KARATSUBA_THRESHOLD);
+    printf("%8s %16s %16s %8s\n", "limbs", "schoolbook (us)", "karatsuba (us)",
+           "speedup");
+
+    for (int count = 8; count <= 4096; count *= 2) {
+        struct lbig* a = random_lbig(count);
+        struct lbig* b = random_lbig(count);
+
+        struct lbig* expected = lbig_mul_schoolbook(a, b);
+        struct lbig* got = lbig_mul_karatsuba(a, b);
+        if (lbig_cmp(expected, got) != 0) {
+            fprintf(stderr, "Karatsuba result differs for %d limbs\n", count);
+            return EXIT_FAILURE;
+        }
+        lbig_del(expected);
+        lbig_del(got);
+
+        double schoolbook = time_mul(lbig_mul_schoolbook, a, b);
+        double karatsuba = time_mul(lbig_mul_karatsuba, a, b);
+        printf("%8d %16.2f %16.2f %7.2fx\n", count, schoolbook, karatsuba,
+               schoolbook / karatsuba);
+
+        lbig_del(a);
+        lbig_del(b);
+    }
+    return EXIT_SUCCESS;
+}
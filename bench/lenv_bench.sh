@@ -0,0 +1,20 @@
+#!/bin/bash
+# Compare the lenv hash table implementations (see src/ltable.h) on lookup
+# heavy workloads. Run from the root of the repository, with `make bench`.
+set -e
+
+TABLES="chain open"
+SCRIPTS="bench/lookup.lspy"
+
+for table in $TABLES; do
+    rm -f lisp
+    make -s LENV_TABLE=$table lisp
+    mv lisp bench/lisp-$table
+done
+
+for script in $SCRIPTS; do
+    for table in $TABLES; do
+        echo "== $script ($table)"
+        time ./bench/lisp-$table $script < /dev/null > /dev/null
+    done
+done
@@ -0,0 +1,102 @@
+/* Measure the cost of one call of the arithmetic, comparison and logic
+ * builtins (see src/evaluation.h), on their most common argument types. The
+ * lists of arguments are built before the calls are timed. Run with
+ * `make bench-ops`.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "evaluation.h"
+#include "lalloc.h"
+#include "lgc.h"
+#include "lsym.h"
+#include "lval.h"
+
+/* Calls timed by a measurement, the best of BENCH_REPEAT measurements is
+ * kept */
+#define BENCH_CALLS 20000
+#define BENCH_REPEAT 15
+
+#define BENCH_MAX_ARGS 8
+
+struct bench_case {
+    const char* name;
+    lbuiltin builtin;
+    int count;
+    struct lval* args[BENCH_MAX_ARGS];
+};
+
+static double
+now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Time of one call, in nanoseconds */
+static double
+time_case(const struct bench_case* c) {
+    static struct lval* lists[BENCH_CALLS];
+    double best = 1e9;
+    for (int r = 0; r < BENCH_REPEAT; ++r) {
+        for (int k = 0; k < BENCH_CALLS; ++k) {
+            lists[k] = lval_sexpr();
+            for (int i = 0; i < c->count; ++i) {
+                lval_add(lists[k], lval_ref(c->args[i]));
+            }
+        }
+        double start = now();
+        for (int k = 0; k < BENCH_CALLS; ++k) {
+            lval_del(c->builtin(NULL, lists[k]));
+        }
+        double elapsed = now() - start;
+        best = (elapsed < best) ? elapsed : best;
+    }
+    return best / BENCH_CALLS * 1e9;
+}
+
+int
+main(void) {
+    lsym_init();
+#ifdef LISPY_GC
+    lgc_init();
+#else
+    lalloc_init(0);
+#endif
+    lval_init();
+
+    struct lval* i1 = lval_int(1234);
+    struct lval* i2 = lval_int(17);
+    struct lval* n1 = lval_num(12.5);
+    struct lval* n2 = lval_num(0.25);
+    struct lval* t = lval_bool(true);
+    struct lval* f = lval_bool(false);
+    struct bench_case cases[] = {
+        {"+ int int", builtin_add, 2, {i1, i2}},
+        {"- int int", builtin_sub, 2, {i1, i2}},
+        {"* int int", builtin_mul, 2, {i1, i2}},
+        {"/ int int", builtin_div, 2, {i1, i2}},
+        {"% int int", builtin_mod, 2, {i1, i2}},
+        {"+ num num", builtin_add, 2, {n1, n2}},
+        {"/ num num", builtin_div, 2, {n1, n2}},
+        {"+ int num", builtin_add, 2, {i1, n2}},
+        {"+ 8 int", builtin_add, 8, {i1, i2, i1, i2, i1, i2, i1, i2}},
+        {"- int", builtin_sub, 1, {i1}},
+        {"> int int", builtin_gt, 2, {i1, i2}},
+        {"<= num num", builtin_le, 2, {n1, n2}},
+        {"== int int", builtin_eq, 2, {i1, i2}},
+        {"!= num num", builtin_ne, 2, {n1, n2}},
+        {"&& bool bool", builtin_and, 2, {t, f}},
+        {"|| 4 bool", builtin_or, 4, {f, f, f, t}},
+        {"! bool", builtin_not, 1, {t}},
+    };
+
+    printf("%-14s %12s\n", "builtin", "ns per call");
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); ++i) {
+        printf("%-14s %12.1f\n", cases[i].name, time_case(&cases[i]));
+    }
+
+    lval_cleanup();
+    return EXIT_SUCCESS;
+}
@@ -31,53 +31,100 @@
             saved_count, c);                                              \
     }
 
+#define LASSERT_NUMBER(name, args, i)                                         \
+    if (!lval_is_number(args->cell[i])) {                                     \
+        int saved_type = lval_type(args->cell[i]);                            \
+        lval_del(args);                                                       \
+        return lval_err(                                                      \
+            "%s : Wrong type for argument %i. Got %s, Expected %s.", name, i, \
+            ltype_name(saved_type), ltype_name(LVAL_NUM));                    \
+    }
+
 #define LASSERT_TYPE(name, args, i, wanted_type)                              \
-    if (args->cell[i]->type != wanted_type) {                                 \
-        int saved_type = args->cell[i]->type;                                 \
+    if (lval_type(args->cell[i]) != wanted_type) {                            \
+        int saved_type = lval_type(args->cell[i]);                            \
         lval_del(args);                                                       \
         return lval_err(                                                      \
             "%s : Wrong type for argument %i. Got %s, Expected %s.", name, i, \
             ltype_name(saved_type), ltype_name(wanted_type));                 \
     }
 
-static struct lval* builtin_op(struct lenv* e, struct lval* a, char* op);
-static struct lval* builtin_log_op(struct lenv* e, struct lval* a, char* op);
+/* The arithmetic, logic and comparison builtins share a kernel, which they
+ * call with a constant operator. Kernels are inlined in each builtin, so that
+ * the operator is known at compile time and its tests disappear : every
+ * builtin is a specialized version of its kernel */
+#ifdef __GNUC__
+#define LKERNEL static inline __attribute__((always_inline))
+#else
+#define LKERNEL static inline
+#endif
+
+/* Operators of builtin_op */
+enum { LNUM_ADD, LNUM_SUB, LNUM_MUL, LNUM_DIV, LNUM_MOD, LNUM_FLOOR };
+static char* const lnum_op_names[] = {"+", "-", "*", "/", "%", "floor"};
+
+/* Operators of builtin_log_op */
+enum { LLOG_OR, LLOG_AND, LLOG_NOT };
+static char* const llog_op_names[] = {"||", "&&", "!"};
+
+/* Operators of builtin_ord */
+enum { LORD_GT, LORD_GE, LORD_LT, LORD_LE };
+static char* const lord_op_names[] = {">", ">=", "<", "<="};
+
+struct lnum;
+static struct lnum lnum_take(struct lval* v);
+static void lnum_del(struct lnum* n);
+static double lnum_double(struct lnum n);
+static void lnum_to_big(struct lnum* n);
+static void lnum_normalize(struct lnum* n);
+static struct lval* lnum_to_lval(struct lnum n);
+static int lval_cmp_integers(struct lval* x, struct lval* y);
+LKERNEL struct lval* builtin_op(struct lval* a, int op);
+LKERNEL struct lval* builtin_log_op(struct lval* a, int op);
 static struct lval* lval_join(struct lval* lhs, struct lval* rhs);
-static struct lval* builtin_var(struct lenv* e, struct lval* a, char* func);
-static struct lval* builtin_ord(struct lenv* e, struct lval* a, char* op);
-static struct lval* builtin_cmp(struct lenv* e, struct lval* a, char* op);
+static struct lval* builtin_var(struct lenv* e, struct lval* a, char* func,
+                                void (*bind)(struct lenv*, struct lval*,
+                                             struct lval*));
+LKERNEL struct lval* builtin_ord(struct lval* a, int op);
+LKERNEL struct lval* builtin_cmp(struct lval* a, bool negate);
 
 static struct lval* load_from_file(struct lenv* e, struct lval* a,
                                    mpc_parser_t* Lispy);
 
 struct lval*
 builtin_add(struct lenv* e, struct lval* x) {
-    return builtin_op(e, x, "+");
+    (void)e;
+    return builtin_op(x, LNUM_ADD);
 }
 
 struct lval*
 builtin_sub(struct lenv* e, struct lval* x) {
-    return builtin_op(e, x, "-");
+    (void)e;
+    return builtin_op(x, LNUM_SUB);
 }
 
 struct lval*
 builtin_mul(struct lenv* e, struct lval* x) {
-    return builtin_op(e, x, "*");
+    (void)e;
+    return builtin_op(x, LNUM_MUL);
 }
 
 struct lval*
 builtin_div(struct lenv* e, struct lval* x) {
-    return builtin_op(e, x, "/");
+    (void)e;
+    return builtin_op(x, LNUM_DIV);
 }
 
 struct lval*
 builtin_mod(struct lenv* e, struct lval* x) {
-    return builtin_op(e, x, "%");
+    (void)e;
+    return builtin_op(x, LNUM_MOD);
 }
 
 struct lval*
 builtin_floor(struct lenv* e, struct lval* x) {
-    return builtin_op(e, x, "floor");
+    (void)e;
+    return builtin_op(x, LNUM_FLOOR);
 }
 
 struct lval*
@@ -86,14 +133,13 @@ builtin_head(struct lenv* e, struct lval* a) {
     LASSERT_TYPE("head", a, 0, LVAL_QEXPR);
     (void)e;
 
+    /* Share the first element instead of copying the whole list */
     if (a->cell[0]->count == 0) {
-        return lval_qexpr();
-    }
-
-    struct lval* v = lval_take(a, 0);
-    while (v->count > 1) {
-        lval_del(lval_pop(v, 1));
+        lval_del(a);
+        return lval_nil();
     }
+    struct lval* v = lval_add(lval_qexpr(), lval_ref(a->cell[0]->cell[0]));
+    lval_del(a);
     return v;
 }
 
@@ -103,11 +149,22 @@ builtin_tail(struct lenv* e, struct lval* a) {
     LASSERT_TYPE("tail", a, 0, LVAL_QEXPR);
     (void)e;
 
-    if (a->cell[0]->count == 0) {
-        return lval_qexpr();
+    /* Here v is the actual {QEXPR} arg */
+    struct lval* v = lval_take(a, 0);
+    if (v->count == 0) {
+        return v;
+    }
+    /* A shared list is not copied : the tail is a slice of it */
+    if (v->refcount > 1) {
+        return lval_slice(v, 1);
+    }
+    if (v->base) {
+        lval_uncache(v);
+        v->cell++;
+        v->count--;
+    } else {
+        lval_del(lval_pop(v, 0));
     }
-    struct lval* v = lval_take(a, 0); /* Here v is the actual {QEXPR} arg */
-    lval_del(lval_pop(v, 0));
     return v;
 }
 
@@ -123,9 +180,12 @@ builtin_eval(struct lenv* e, struct lval* a) {
     LASSERT_NUM_ARGS("eval", a, 1);
     LASSERT_TYPE("eval", a, 0, LVAL_QEXPR);
 
-    struct lval* x = lval_take(a, 0);
-    x->type = LVAL_SEXPR;
-    return lval_eval(e, x);
+    /* The Q-expression is evaluated as a S-expression, without being copied
+     * nor changed */
+    struct lval* x = a->cell[0];
+    struct lval* result = lval_eval_cells(e, x->cell, x->count);
+    lval_del(a);
+    return result;
 }
 
 struct lval*
@@ -135,7 +195,7 @@ builtin_join(struct lenv* e, struct lval* a) {
     }
     (void)e;
 
-    struct lval* x = lval_pop(a, 0);
+    struct lval* x = lval_own(lval_pop(a, 0));
 
     while (a->count > 0) {
         x = lval_join(x, lval_pop(a, 0));
@@ -145,10 +205,34 @@ builtin_join(struct lenv* e, struct lval* a) {
     return x;
 }
 
+/* Append the cells of rhs to lhs, which must be owned */
 static struct lval*
 lval_join(struct lval* lhs, struct lval* rhs) {
-    while (rhs->count > 0) {
-        lhs = lval_add(lhs, lval_pop(rhs, 0));
+    /* The cells can be moved out of rhs if nobody else uses it */
+    bool move = (rhs->refcount == 1 && !rhs->base);
+
+    /* Prepending a few cells to a long list that nobody else uses is done in
+     * its free slots, so that lists built front to back cost linear time */
+    if (move && lhs->count < rhs->count) {
+        lval_uncache(rhs);
+        lval_reserve(rhs, lhs->count, 0);
+        rhs->cell -= lhs->count;
+        rhs->count += lhs->count;
+        if (lhs->count > 0) {
+            memcpy(rhs->cell, lhs->cell, sizeof(struct lval*) * lhs->count);
+        }
+        rhs->type = lhs->type;
+        lhs->count = 0;
+        lval_del(lhs);
+        return rhs;
+    }
+
+    lval_reserve(lhs, 0, rhs->count);
+    for (int i = 0; i < rhs->count; ++i) {
+        lhs->cell[lhs->count++] = move ? rhs->cell[i] : lval_ref(rhs->cell[i]);
+    }
+    if (move) {
+        rhs->count = 0;
     }
 
     lval_del(rhs);
@@ -163,8 +247,7 @@ builtin_cons(struct lenv* e, struct lval* a) {
 
     struct lval* ans = lval_qexpr();
     lval_add(ans, v);
-    lval_join(ans, lval_take(a, 0));
-    return ans;
+    return lval_join(ans, lval_take(a, 0));
 }
 
 struct lval*
@@ -172,88 +255,317 @@ builtin_len(struct lenv* e, struct lval* a) {
     LASSERT_NUM_ARGS("len", a, 1);
     LASSERT_TYPE("len", a, 0, LVAL_QEXPR);
     (void)e;
-    struct lval* ans = lval_num(a->cell[0]->count);
-
+    struct lval* ans = lval_int(a->cell[0]->count);
+    lval_del(a);
     return ans;
 }
 
 struct lval*
 builtin_init(struct lenv* e, struct lval* a) {
     LASSERT_NUM_ARGS("init", a, 1);
+    LASSERT_TYPE("init", a, 0, LVAL_QEXPR);
     LASSERT_NON_EMPTY("init", a);
     (void)e;
 
-    lval_del(lval_pop(a->cell[0], a->cell[0]->count - 1));
-    return a->cell[0];
+    struct lval* v = lval_own(lval_take(a, 0));
+    lval_del(lval_pop(v, v->count - 1));
+    return v;
+}
+
+/* Running value of builtin_op. Integers stay int64 while they fit, become
+ * big integers when an operation overflows, and a number operand turns the
+ * value into a double */
+struct lnum {
+    int type; /* LVAL_INT, LVAL_BIG or LVAL_NUM */
+    int64_t i;
+    struct lbig* big; /* Owned */
+    double d;
+};
+
+/* Read a LVAL_INT, LVAL_BIG or LVAL_NUM, and delete it */
+static struct lnum
+lnum_take(struct lval* v) {
+    struct lnum n = {.type = lval_type(v)};
+    switch (n.type) {
+        case LVAL_INT:
+            n.i = lval_to_int(v);
+            break;
+        case LVAL_BIG:
+            n.big = lbig_copy(v->big);
+            break;
+        default:
+            n.d = lval_to_num(v);
+            break;
+    }
+    lval_del(v);
+    return n;
+}
+
+static void
+lnum_del(struct lnum* n) {
+    if (n->type == LVAL_BIG) {
+        lbig_del(n->big);
+    }
+}
+
+static double
+lnum_double(struct lnum n) {
+    switch (n.type) {
+        case LVAL_INT:
+            return (double)n.i;
+        case LVAL_BIG:
+            return lbig_to_double(n.big);
+        default:
+            return n.d;
+    }
+}
+
+static void
+lnum_to_big(struct lnum* n) {
+    if (n->type == LVAL_INT) {
+        n->big = lbig_from_int(n->i);
+        n->type = LVAL_BIG;
+    }
+}
+
+/* Go back to the int64 fast path when a big integer is small enough */
+static void
+lnum_normalize(struct lnum* n) {
+    int64_t i;
+    if (n->type == LVAL_BIG && lbig_to_int(n->big, &i)) {
+        lbig_del(n->big);
+        n->type = LVAL_INT;
+        n->i = i;
+    }
 }
 
 static struct lval*
-builtin_op(struct lenv* e, struct lval* a, char* op) {
+lnum_to_lval(struct lnum n) {
+    switch (n.type) {
+        case LVAL_INT:
+            return lval_int(n.i);
+        case LVAL_BIG:
+            return lval_big(n.big);
+        default:
+            return lval_num(n.d);
+    }
+}
+
+/* Compute x op y in r on int64. Return false if the result is not an int64 :
+ * overflow, division with a remainder or by zero */
+LKERNEL bool
+lnum_int_apply(int64_t x, int64_t y, int op, int64_t* r) {
+    switch (op) {
+        case LNUM_ADD:
+            return !__builtin_add_overflow(x, y, r);
+        case LNUM_SUB:
+            return !__builtin_sub_overflow(x, y, r);
+        case LNUM_MUL:
+            return !__builtin_mul_overflow(x, y, r);
+        case LNUM_DIV:
+            /* INT64_MIN / -1 overflows */
+            if (y == 0 || (y == -1 && x == INT64_MIN) || x % y != 0) {
+                return false;
+            }
+            *r = x / y;
+            return true;
+        case LNUM_MOD:
+            if (y == 0) {
+                return false;
+            }
+            /* INT64_MIN % -1 overflows in C */
+            *r = (y == -1) ? 0 : x % y;
+            return true;
+        default:
+            return false;
+    }
+}
+
+/* Compute x op y in r on doubles. Return false on a division by zero */
+LKERNEL bool
+lnum_num_apply(double x, double y, int op, double* r) {
+    switch (op) {
+        case LNUM_ADD:
+            *r = x + y;
+            return true;
+        case LNUM_SUB:
+            *r = x - y;
+            return true;
+        case LNUM_MUL:
+            *r = x * y;
+            return true;
+        case LNUM_DIV:
+            if (y == 0) {
+                return false;
+            }
+            *r = x / y;
+            return true;
+        case LNUM_MOD:
+            if (y == 0) {
+                return false;
+            }
+            *r = fmod(x, y);
+            return true;
+        default:
+            return false;
+    }
+}
+
+/* Compute x op y in x, y is consumed. Return false on a division by zero.
+ * Integer operations are exact : they are done on int64 first, again on big
+ * integers when that overflows, and with doubles when a division has a
+ * remainder */
+LKERNEL bool
+lnum_apply(struct lnum* x, struct lnum y, int op) {
+    bool big = (x->type != LVAL_NUM && y.type != LVAL_NUM);
+    if (x->type == LVAL_INT && y.type == LVAL_INT) {
+        int64_t r;
+        if (lnum_int_apply(x->i, y.i, op, &r)) {
+            x->i = r;
+            return true;
+        }
+        if (y.i == 0 && (op == LNUM_DIV || op == LNUM_MOD)) {
+            return false;
+        }
+        /* Only overflows need big integers : a division of int64 with a
+         * remainder has a remainder with big integers too */
+        big = (op != LNUM_DIV || y.i == -1);
+    }
+
+    if (big) {
+        lnum_to_big(x);
+        lnum_to_big(&y);
+        struct lbig* r = NULL;
+        switch (op) {
+            case LNUM_ADD:
+                r = lbig_add(x->big, y.big);
+                break;
+            case LNUM_SUB:
+                r = lbig_sub(x->big, y.big);
+                break;
+            case LNUM_MUL:
+                r = lbig_mul(x->big, y.big);
+                break;
+            case LNUM_DIV:
+            case LNUM_MOD: {
+                struct lbig* q;
+                struct lbig* rem;
+                if (!lbig_divmod(x->big, y.big, &q, &rem)) {
+                    lnum_del(&y);
+                    return false;
+                }
+                bool mod = (op == LNUM_MOD);
+                if (mod || rem->count == 0) {
+                    r = mod ? rem : q;
+                    lbig_del(mod ? q : rem);
+                } else {
+                    lbig_del(q);
+                    lbig_del(rem);
+                }
+                break;
+            }
+        }
+        if (r) {
+            lnum_del(x);
+            lnum_del(&y);
+            x->big = r;
+            lnum_normalize(x);
+            return true;
+        }
+    }
+
+    double a = lnum_double(*x);
+    double b = lnum_double(y);
+    lnum_del(x);
+    lnum_del(&y);
+    x->type = LVAL_NUM;
+    return lnum_num_apply(a, b, op, &x->d);
+}
+
+LKERNEL struct lval*
+builtin_op(struct lval* a, int op) {
+    char* name = lnum_op_names[op];
     if (a->type == LVAL_ERR) {
         return a;
     }
 
-    struct lval* x = lval_pop(a, 0);
-    if (strcmp(op, "-") == 0 && a->count == 0) {
-        x->num = -x->num;
+    /* Two integers or two numbers, the most frequent calls, need neither the
+     * loop nor the promotions */
+    if (a->count == 2 && op != LNUM_FLOOR) {
+        struct lval* x = a->cell[0];
+        struct lval* y = a->cell[1];
+        if (lval_type(x) == LVAL_INT && lval_type(y) == LVAL_INT) {
+            int64_t r;
+            if (lnum_int_apply(lval_to_int(x), lval_to_int(y), op, &r)) {
+                lval_del(a);
+                return lval_int(r);
+            }
+        } else if (lval_type(x) == LVAL_NUM && lval_type(y) == LVAL_NUM) {
+            double r;
+            if (lnum_num_apply(lval_to_num(x), lval_to_num(y), op, &r)) {
+                lval_del(a);
+                return lval_num(r);
+            }
+        }
     }
 
-    if (strcmp(op, "floor") == 0) {
-        if (a->count == 0) {
-            x->num = floor(x->num);
+    LASSERT(a, a->count > 0, "%s : Expected at least one argument", name);
+    for (int i = 0; i < a->count; ++i) {
+        LASSERT_NUMBER(name, a, i);
+    }
+
+    struct lnum x = lnum_take(lval_pop(a, 0));
+    if (op == LNUM_SUB && a->count == 0) {
+        if (x.type == LVAL_INT && x.i != INT64_MIN) {
+            x.i = -x.i;
+        } else if (x.type == LVAL_NUM) {
+            x.d = -x.d;
         } else {
+            lnum_to_big(&x);
+            struct lbig* neg = lbig_neg(x.big);
+            lbig_del(x.big);
+            x.big = neg;
+            lnum_normalize(&x);
+        }
+    }
+
+    if (op == LNUM_FLOOR) {
+        if (a->count != 0) {
+            lnum_del(&x);
             lval_del(a);
             return lval_err("floor expects one argument !");
         }
+        if (x.type == LVAL_NUM) {
+            x.d = floor(x.d);
+        }
     }
 
     while (a->count > 0) {
-        LASSERT_TYPE(op, a, 0, LVAL_NUM);
-        struct lval* y = lval_eval(e, lval_pop(a, 0));
-        if (strcmp(op, "+") == 0) {
-            x->num += y->num;
-        }
-        if (strcmp(op, "-") == 0) {
-            x->num -= y->num;
-        }
-        if (strcmp(op, "*") == 0) {
-            x->num *= y->num;
-        }
-        if (strcmp(op, "/") == 0) {
-            if (y->num == 0) {
-                lval_del(x);
-                lval_del(y);
-                x = lval_err("division by zero");
-                break;
-            }
-            x->num /= y->num;
-        }
-        if (strcmp(op, "%") == 0) {
-            if (y->num == 0) {
-                lval_del(x);
-                lval_del(y);
-                x = lval_err("division by zero");
-                break;
-            }
-            x->num = (int)round(x->num) % (int)round(y->num);
+        if (!lnum_apply(&x, lnum_take(lval_pop(a, 0)), op)) {
+            lnum_del(&x);
+            lval_del(a);
+            return lval_err("division by zero");
         }
-        lval_del(y);
     }
 
     lval_del(a);
-    return x;
+    return lnum_to_lval(x);
 }
 
-static struct lval*
-builtin_log_op(struct lenv* e, struct lval* a, char* op) {
+LKERNEL struct lval*
+builtin_log_op(struct lval* a, int op) {
+    char* name = llog_op_names[op];
     if (a->type == LVAL_ERR) {
         return a;
     }
+    LASSERT(a, a->count > 0, "%s : Expected at least one argument", name);
+    LASSERT_TYPE(name, a, 0, LVAL_BOOL);
 
-    struct lval* x = lval_pop(a, 0);
-    if (strcmp(op, "!") == 0) {
+    /* Booleans are immediates : the arguments need no lval_del */
+    bool x = lval_to_bool(lval_pop(a, 0));
+    if (op == LLOG_NOT) {
         if (a->count == 0) {
-            x->t = !x->t;
+            x = !x;
         } else {
             lval_del(a);
             return lval_err("not (!) expects one argument !");
@@ -261,45 +573,42 @@ builtin_log_op(struct lenv* e, struct lval* a, char* op) {
     }
 
     while (a->count > 0) {
-        LASSERT_TYPE(op, a, 0, LVAL_BOOL);
-        struct lval* y = lval_eval(e, lval_pop(a, 0));
-        if (strcmp(op, "||") == 0) {
-            x->t = (x->t || y->t);
-        }
-        if (strcmp(op, "&&") == 0) {
-            x->t = (x->t && y->t);
-        }
-        lval_del(y);
+        LASSERT_TYPE(name, a, 0, LVAL_BOOL);
+        bool y = lval_to_bool(lval_pop(a, 0));
+        x = (op == LLOG_OR) ? (x || y) : (x && y);
     }
 
     lval_del(a);
-    return x;
+    return lval_bool(x);
 }
 
 struct lval*
 builtin_def(struct lenv* e, struct lval* a) {
-    return builtin_var(e, a, "def");
+    return builtin_var(e, a, "def", lenv_def);
 }
 
 struct lval*
 builtin_put(struct lenv* e, struct lval* a) {
-    return builtin_var(e, a, "=");
+    return builtin_var(e, a, "=", lenv_put);
 }
 
+/* def or =, whose bindings are made by bind */
 static struct lval*
-builtin_var(struct lenv* e, struct lval* x, char* func) {
+builtin_var(struct lenv* e, struct lval* x, char* func,
+            void (*bind)(struct lenv*, struct lval*, struct lval*)) {
     LASSERT_TYPE(func, x, 0, LVAL_QEXPR);
 
     struct lval* syms = x->cell[0];
 
     for (int i = 0; i < syms->count; ++i) {
-        LASSERT(x, syms->cell[i]->type == LVAL_SYM,
+        LASSERT(x, lval_type(syms->cell[i]) == LVAL_SYM,
                 "Function '%s' cannot define non-symbol. Got %s, Expected %s.",
-                func, ltype_name(syms->cell[i]->type), ltype_name(LVAL_SYM));
+                func, ltype_name(lval_type(syms->cell[i])),
+                ltype_name(LVAL_SYM));
         if (lenv_is_builtin(e, syms->cell[i])) {
             struct lval* err =
                 lval_err("def/fun/= : %s is already a builtin function !",
-                         syms->cell[i]->sym);
+                         lval_to_sym(syms->cell[i]));
             lval_del(x);
             return err;
         }
@@ -311,16 +620,11 @@ builtin_var(struct lenv* e, struct lval* x, char* func) {
             func, syms->count, x->count - 1);
 
     for (int i = 0; i < syms->count; ++i) {
-        if (strcmp(func, "def") == 0) {
-            lenv_def(e, syms->cell[i], x->cell[i + 1]);
-        }
-        if (strcmp(func, "=") == 0) {
-            lenv_put(e, syms->cell[i], x->cell[i + 1]);
-        }
+        bind(e, syms->cell[i], x->cell[i + 1]);
     }
 
     lval_del(x);
-    return lval_sexpr();
+    return lval_unit();
 }
 
 struct lval*
@@ -330,13 +634,14 @@ builtin_lambda(struct lenv* e, struct lval* a) {
     LASSERT_TYPE("\\", a, 1, LVAL_QEXPR);
 
     for (int i = 0; i < a->cell[0]->count; ++i) {
-        LASSERT(a, (a->cell[0]->cell[i]->type == LVAL_SYM),
+        LASSERT(a, (lval_type(a->cell[0]->cell[i]) == LVAL_SYM),
                 "Cannot define non-symbol. Got %s, Expected %s.",
-                ltype_name(a->cell[0]->cell[i]->type), ltype_name(LVAL_SYM));
+                ltype_name(lval_type(a->cell[0]->cell[i])),
+                ltype_name(LVAL_SYM));
         if (lenv_is_builtin(e, a->cell[0]->cell[i])) {
             struct lval* err =
                 lval_err("def/fun/= : %s is already a builtin function !",
-                         a->cell[0]->cell[i]->sym);
+                         lval_to_sym(a->cell[0]->cell[i]));
             lval_del(a);
             return err;
         }
@@ -357,19 +662,20 @@ builtin_fun(struct lenv* e, struct lval* a) {
     LASSERT_TYPE("fun", a, 1, LVAL_QEXPR);
 
     for (int i = 0; i < a->cell[0]->count; ++i) {
-        LASSERT(a, (a->cell[0]->cell[i]->type == LVAL_SYM),
+        LASSERT(a, (lval_type(a->cell[0]->cell[i]) == LVAL_SYM),
                 "Cannot define non-symbol. Got %s, Expected %s.",
-                ltype_name(a->cell[0]->cell[i]->type), ltype_name(LVAL_SYM));
+                ltype_name(lval_type(a->cell[0]->cell[i])),
+                ltype_name(LVAL_SYM));
         if (lenv_is_builtin(e, a->cell[0]->cell[i])) {
             struct lval* err =
                 lval_err("def/fun/= : %s is already a builtin function !",
-                         a->cell[0]->cell[i]->sym);
+                         lval_to_sym(a->cell[0]->cell[i]));
             lval_del(a);
             return err;
         }
     }
 
-    struct lval* formals = lval_pop(a, 0);
+    struct lval* formals = lval_own(lval_pop(a, 0));
     /* If the first argument of fun was {}, sym will by an error, therefore
      * builtin_def will catch it, and prevent the binding from happening */
     struct lval* sym = lval_pop(formals, 0);
@@ -387,91 +693,150 @@ builtin_fun(struct lenv* e, struct lval* a) {
     return builtin_def(e, def_args);
 }
 
+struct lval*
+builtin_let(struct lenv* e, struct lval* a) {
+    LASSERT_NUM_ARGS("let", a, 1);
+    LASSERT_TYPE("let", a, 0, LVAL_QEXPR);
+
+    /* A lambda without formals created in e, so that it captures from e */
+    struct lval* f = lval_lambda(lval_qexpr(), lval_pop(a, 0), e);
+    struct lval* result = lval_call(e, f, a);
+    lval_del(f);
+    return result;
+}
+
 struct lval*
 builtin_gt(struct lenv* e, struct lval* a) {
-    return builtin_ord(e, a, ">");
+    (void)e;
+    return builtin_ord(a, LORD_GT);
 }
 
 struct lval*
 builtin_ge(struct lenv* e, struct lval* a) {
-    return builtin_ord(e, a, ">=");
+    (void)e;
+    return builtin_ord(a, LORD_GE);
 }
 
 struct lval*
 builtin_lt(struct lenv* e, struct lval* a) {
-    return builtin_ord(e, a, "<");
+    (void)e;
+    return builtin_ord(a, LORD_LT);
 }
 
 struct lval*
 builtin_le(struct lenv* e, struct lval* a) {
-    return builtin_ord(e, a, "<=");
-}
+    (void)e;
+    return builtin_ord(a, LORD_LE);
+}
+
+/* Apply the comparison op to x and y, which are int64 or doubles */
+#define LORD_APPLY(op, x, y)                     \
+    ((op) == LORD_GT   ? (x) > (y)               \
+     : (op) == LORD_GE ? (x) >= (y)              \
+     : (op) == LORD_LT ? (x) < (y)               \
+                       : (x) <= (y))
+
+LKERNEL struct lval*
+builtin_ord(struct lval* a, int op) {
+    char* name = lord_op_names[op];
+    LASSERT_NUM_ARGS(name, a, 2);
+    struct lval* x = a->cell[0];
+    struct lval* y = a->cell[1];
+
+    /* Two integers or two numbers, the most frequent calls */
+    if (lval_type(x) == LVAL_INT && lval_type(y) == LVAL_INT) {
+        bool r = LORD_APPLY(op, lval_to_int(x), lval_to_int(y));
+        lval_del(a);
+        return lval_bool(r);
+    }
+    if (lval_type(x) == LVAL_NUM && lval_type(y) == LVAL_NUM) {
+        bool r = LORD_APPLY(op, lval_to_num(x), lval_to_num(y));
+        lval_del(a);
+        return lval_bool(r);
+    }
 
-static struct lval*
-builtin_ord(struct lenv* e, struct lval* a, char* op) {
-    LASSERT_NUM_ARGS(op, a, 2);
-    LASSERT_TYPE(op, a, 0, LVAL_NUM);
-    LASSERT_TYPE(op, a, 1, LVAL_NUM);
-    double left_val = a->cell[0]->num;
-    double right_val = a->cell[1]->num;
-    lval_del(a);
+    LASSERT_NUMBER(name, a, 0);
+    LASSERT_NUMBER(name, a, 1);
 
-    if (strcmp(op, ">") == 0) {
-        return lval_bool(left_val > right_val);
+    /* Integers are compared exactly, to numbers as well. NaN is unordered */
+    bool r;
+    if (lval_type(x) != LVAL_NUM && lval_type(y) != LVAL_NUM) {
+        r = LORD_APPLY(op, lval_cmp_integers(x, y), 0);
+    } else if (lval_type(y) == LVAL_NUM) {
+        double d = lval_to_num(y);
+        r = (d == d) && LORD_APPLY(op, lval_cmp_int_num(x, d), 0);
+    } else {
+        double d = lval_to_num(x);
+        r = (d == d) && LORD_APPLY(op, 0, lval_cmp_int_num(y, d));
     }
-    if (strcmp(op, ">=") == 0) {
-        return lval_bool(left_val >= right_val);
+    lval_del(a);
+    return lval_bool(r);
+}
+
+/* Compare two LVAL_INT or LVAL_BIG, return -1, 0 or 1 */
+static int
+lval_cmp_integers(struct lval* x, struct lval* y) {
+    if (lval_type(x) == LVAL_INT && lval_type(y) == LVAL_INT) {
+        int64_t left = lval_to_int(x);
+        int64_t right = lval_to_int(y);
+        return (left > right) - (left < right);
     }
-    if (strcmp(op, "<") == 0) {
-        return lval_bool(left_val < right_val);
+
+    /* Immediates have no big field : promote them to temporaries */
+    bool left_tmp = (lval_type(x) == LVAL_INT);
+    bool right_tmp = (lval_type(y) == LVAL_INT);
+    struct lbig* left = left_tmp ? lbig_from_int(lval_to_int(x)) : x->big;
+    struct lbig* right = right_tmp ? lbig_from_int(lval_to_int(y)) : y->big;
+    int cmp = lbig_cmp(left, right);
+    if (left_tmp) {
+        lbig_del(left);
     }
-    if (strcmp(op, "<=") == 0) {
-        return lval_bool(left_val <= right_val);
+    if (right_tmp) {
+        lbig_del(right);
     }
-
-    return lval_err("%s : comparison operator not found", op);
+    return cmp;
 }
 
 struct lval*
 builtin_eq(struct lenv* e, struct lval* a) {
-    return builtin_cmp(e, a, "==");
+    (void)e;
+    return builtin_cmp(a, false);
 }
 
 struct lval*
 builtin_ne(struct lenv* e, struct lval* a) {
-    return builtin_cmp(e, a, "!=");
+    (void)e;
+    return builtin_cmp(a, true);
 }
 
 struct lval*
 builtin_or(struct lenv* e, struct lval* a) {
-    return builtin_log_op(e, a, "||");
+    (void)e;
+    return builtin_log_op(a, LLOG_OR);
 }
 
 struct lval*
 builtin_and(struct lenv* e, struct lval* a) {
-    return builtin_log_op(e, a, "&&");
+    (void)e;
+    return builtin_log_op(a, LLOG_AND);
 }
 
 struct lval*
 builtin_not(struct lenv* e, struct lval* a) {
-    return builtin_log_op(e, a, "!");
+    (void)e;
+    return builtin_log_op(a, LLOG_NOT);
 }
 
-static struct lval*
-builtin_cmp(struct lenv* e, struct lval* a, char* op) {
-    (void)e;
-    LASSERT_NUM_ARGS(op, a, 2);
+/* == and its negation != */
+LKERNEL struct lval*
+builtin_cmp(struct lval* a, bool negate) {
+    LASSERT_NUM_ARGS(negate ? "!=" : "==", a, 2);
 
-    int r;
-    if (strcmp(op, "==") == 0) {
-        r = lval_eq(a->cell[0], a->cell[1]);
-    }
-    if (strcmp(op, "!=") == 0) {
-        r = !lval_eq(a->cell[0], a->cell[1]);
-    }
+    bool r = lval_eq(a->cell[0], a->cell[1]);
     lval_del(a);
-    return lval_bool(r);
+    return lval_bool(negate ? !r : r);
 }
+
 struct lval*
 builtin_cond(struct lenv* e, struct lval* a) {
     LASSERT_NUM_ARGS("cond", a, 3);
@@ -479,22 +844,57 @@ builtin_cond(struct lenv* e, struct lval* a) {
     LASSERT_TYPE("cond", a, 1, LVAL_QEXPR);
     LASSERT_TYPE("cond", a, 2, LVAL_QEXPR);
 
-    /* Mark Both Expressions as evaluable */
-    struct lval* x;
-    a->cell[1]->type = LVAL_SEXPR;
-    a->cell[2]->type = LVAL_SEXPR;
+    /* Evaluate the first expression if the condition is true, the second one
+     * otherwise. The argument list keeps the branch alive meanwhile */
+    struct lval* x = a->cell[lval_to_bool(a->cell[0]) ? 1 : 2];
+    struct lval* result = lval_eval_cells(e, x->cell, x->count);
+    lval_del(a);
+    return result;
+}
 
-    if (a->cell[0]->t) {
-        /* If condition is true evaluate first expression */
-        x = lval_eval(e, lval_pop(a, 1));
-    } else {
-        /* Otherwise evaluate second expression */
-        x = lval_eval(e, lval_pop(a, 2));
+struct lval*
+builtin_select(struct lenv* e, struct lval* a) {
+    for (int i = 0; i < a->count; ++i) {
+        LASSERT_TYPE("select", a, i, LVAL_QEXPR);
+        LASSERT(a, a->cell[i]->count == 2,
+                "select : Wrong number of values in clause %i. Got %i, "
+                "Expected 2.",
+                i, a->cell[i]->count);
     }
 
-    /* Delete argument list and return */
+    for (int i = 0; i < a->count; ++i) {
+        struct lval* clause = a->cell[i];
+        struct lval* test = lval_eval_borrowed(e, clause->cell[0]);
+        if (test == LVAL_TRUE) {
+            struct lval* x = lval_eval_borrowed(e, clause->cell[1]);
+            lval_del(a);
+            return x;
+        }
+        if (test != LVAL_FALSE) {
+            lval_del(a);
+            if (lval_type(test) == LVAL_ERR) {
+                return test;
+            }
+            /* The error of cond, which select used to be written with */
+            int type = lval_type(test);
+            lval_del(test);
+            return lval_err(
+                "%s : Wrong type for argument %i. Got %s, Expected %s.",
+                "cond", 0, ltype_name(type), ltype_name(LVAL_BOOL));
+        }
+    }
     lval_del(a);
-    return x;
+    return lval_err("No Selection Found");
+}
+
+struct lval*
+builtin_do(struct lenv* e, struct lval* a) {
+    (void)e;
+    if (a->count == 0) {
+        lval_del(a);
+        return lval_nil();
+    }
+    return lval_take(a, a->count - 1);
 }
 
 struct lval*
@@ -512,9 +912,10 @@ load_from_file(struct lenv* e, struct lval* a, mpc_parser_t* Lispy) {
         struct lval* expr = lval_read(r.output);
         mpc_ast_delete(r.output);
 
-        while (expr->count) {
-            struct lval* x = lval_eval(e, lval_pop(expr, 0));
-            if (x->type == LVAL_ERR) {
+        /* The forms are evaluated where they were read */
+        for (int i = 0; i < expr->count; ++i) {
+            struct lval* x = lval_eval_borrowed(e, expr->cell[i]);
+            if (lval_type(x) == LVAL_ERR) {
                 lval_println(x);
             }
             lval_del(x);
@@ -523,7 +924,7 @@ load_from_file(struct lenv* e, struct lval* a, mpc_parser_t* Lispy) {
         lval_del(expr);
         lval_del(a);
 
-        return lval_sexpr();
+        return lval_unit();
     } else {
         char* err_msg = mpc_err_string(r.error);
         mpc_err_delete(r.error);
@@ -546,7 +947,7 @@ builtin_print(struct lenv* e, struct lval* a) {
 
     putchar('\n');
     lval_del(a);
-    return lval_sexpr();
+    return lval_unit();
 }
 
 struct lval*
@@ -559,7 +960,7 @@ builtin_show(struct lenv* e, struct lval* a) {
 
     putchar('\n');
     lval_del(a);
-    return lval_sexpr();
+    return lval_unit();
 }
 
 struct lval*
@@ -139,6 +139,19 @@ struct lval* builtin_not(struct lenv* e, struct lval* a);
  */
 struct lval* builtin_cond(struct lenv* e, struct lval* a);
 
+/** Computes (select {test value}...) where every clause is a Q-Expression
+ * Evaluates the tests in order, and returns the value of the clause of the
+ * first one which is t
+ * Returns an error if no test is t, or if a test is not a bool (the error of
+ * cond)
+ */
+struct lval* builtin_select(struct lenv* e, struct lval* a);
+
+/** Computes (do x...) where x is a list of evaluated expressions
+ * Returns the last element of x, or nil if x is empty
+ */
+struct lval* builtin_do(struct lenv* e, struct lval* a);
+
 /** Computes (\ {args} {body}) where args is a list of symbols and body is
  * evaluable
  * Returns a function objects which will map the arguments in the body before
@@ -162,6 +175,13 @@ struct lval* builtin_lambda(struct lenv* e, struct lval* x);
  */
 struct lval* builtin_fun(struct lenv* e, struct lval* x);
 
+/** Computes (let {body}) where body is evaluable
+ * Evaluates body in a new scope, so that the names it binds with = stay in
+ * it. The lambdas it creates capture the bindings of e, the environment let
+ * is called in
+ */
+struct lval* builtin_let(struct lenv* e, struct lval* x);
+
 /** Load a file and evaluate it
  * Returns an error with the message if the parsing went wrong
  */
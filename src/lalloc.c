@@ -0,0 +1,316 @@
+#include "lalloc.h"
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+#include "lenv.h"
+#include "lval.h"
+
+#define LALLOC_BLOCK_SIZE (64 * 1024)
+#define LALLOC_ALIGN 16
+
+/* Retired blocks are reused as nursery only if this fraction is free */
+#define LALLOC_RECYCLE_RATIO 4
+
+/* Empty blocks kept mapped by each pool, the others are unmapped */
+#define LALLOC_EMPTY_RESERVE 2
+
+struct lalloc_pool;
+
+/* Header at the start of every block, blocks are aligned on their size so the
+ * block of an object is found by masking its address */
+struct lalloc_block {
+    struct lalloc_pool* pool;
+
+    /* Links in the old space or in the list of empty blocks */
+    struct lalloc_block* prev;
+    struct lalloc_block* next;
+
+    char* start;
+    char* bump;
+    char* end;
+
+    /* Freed slots between start and bump */
+    void* free_list;
+
+    int live;
+    int capacity;
+};
+
+struct lalloc_pool {
+    const char* name;
+    size_t size;
+    struct lalloc_block* nursery;
+    struct lalloc_block* old;
+    struct lalloc_block* empty;
+    int empty_count;
+
+    /* Statistics */
+    unsigned long allocs;
+    unsigned long frees;
+    unsigned long live;
+    unsigned long peak_live;
+    unsigned long resets;
+    unsigned long promotions;
+    unsigned long blocks_mapped;
+    unsigned long blocks_unmapped;
+};
+
+static _Thread_local struct lalloc_pool lalloc_pools[LALLOC_KINDS];
+
+static bool lalloc_stats;
+
+static void lalloc_pool_init(struct lalloc_pool* p, const char* name,
+                             size_t size);
+static struct lalloc_block* lalloc_block_new(struct lalloc_pool* p);
+static void lalloc_block_unmap(struct lalloc_block* b);
+static void lalloc_block_reset(struct lalloc_block* b);
+static void lalloc_unlink(struct lalloc_block** list, struct lalloc_block* b);
+static void lalloc_push(struct lalloc_block** list, struct lalloc_block* b);
+static void lalloc_promote(struct lalloc_pool* p);
+static void lalloc_retire(struct lalloc_pool* p, struct lalloc_block* b);
+static void lalloc_unmap_list(struct lalloc_block* b);
+static void lalloc_foreach_block(struct lalloc_block* b,
+                                 void (*visit)(void*, void*), void* ctx);
+
+void
+lalloc_init(size_t header) {
+    lalloc_stats = (getenv("LISPY_ALLOC_STATS") != NULL);
+    lalloc_pool_init(&lalloc_pools[LALLOC_LVAL], "lval",
+                     header + sizeof(struct lval));
+    lalloc_pool_init(&lalloc_pools[LALLOC_LENV], "lenv",
+                     header + sizeof(struct lenv));
+}
+
+static void
+lalloc_pool_init(struct lalloc_pool* p, const char* name, size_t size) {
+    *p = (struct lalloc_pool){0};
+    p->name = name;
+    p->size = (size + LALLOC_ALIGN - 1) & ~(size_t)(LALLOC_ALIGN - 1);
+    p->nursery = lalloc_block_new(p);
+}
+
+/* Map twice the block size and trim it to get an aligned block */
+static struct lalloc_block*
+lalloc_block_new(struct lalloc_pool* p) {
+    char* map = mmap(NULL, 2 * LALLOC_BLOCK_SIZE, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    assert(map != MAP_FAILED);
+    char* aligned = (char*)(((uintptr_t)map + LALLOC_BLOCK_SIZE - 1) &
+                            ~(uintptr_t)(LALLOC_BLOCK_SIZE - 1));
+    if (aligned > map) {
+        munmap(map, aligned - map);
+    }
+    if (aligned + LALLOC_BLOCK_SIZE < map + 2 * LALLOC_BLOCK_SIZE) {
+        munmap(aligned + LALLOC_BLOCK_SIZE,
+               map + LALLOC_BLOCK_SIZE - aligned);
+    }
+
+    struct lalloc_block* b = (struct lalloc_block*)aligned;
+    size_t header = (sizeof(struct lalloc_block) + LALLOC_ALIGN - 1) &
+                    ~(size_t)(LALLOC_ALIGN - 1);
+    b->pool = p;
+    b->prev = NULL;
+    b->next = NULL;
+    b->start = aligned + header;
+    b->capacity = (LALLOC_BLOCK_SIZE - header) / p->size;
+    b->end = b->start + b->capacity * p->size;
+    lalloc_block_reset(b);
+    p->blocks_mapped++;
+    return b;
+}
+
+static void
+lalloc_block_unmap(struct lalloc_block* b) {
+    munmap(b, LALLOC_BLOCK_SIZE);
+}
+
+/* Only called on blocks without live objects */
+static void
+lalloc_block_reset(struct lalloc_block* b) {
+    b->bump = b->start;
+    b->free_list = NULL;
+    b->live = 0;
+}
+
+static void
+lalloc_unlink(struct lalloc_block** list, struct lalloc_block* b) {
+    if (b->prev) {
+        b->prev->next = b->next;
+    } else {
+        *list = b->next;
+    }
+    if (b->next) {
+        b->next->prev = b->prev;
+    }
+    b->prev = NULL;
+    b->next = NULL;
+}
+
+static void
+lalloc_push(struct lalloc_block** list, struct lalloc_block* b) {
+    b->prev = NULL;
+    b->next = *list;
+    if (*list) {
+        (*list)->prev = b;
+    }
+    *list = b;
+}
+
+/* Retire the full nursery to the old space, and pick the next one */
+static void
+lalloc_promote(struct lalloc_pool* p) {
+    lalloc_push(&p->old, p->nursery);
+    p->promotions++;
+
+    if (p->empty) {
+        struct lalloc_block* b = p->empty;
+        lalloc_unlink(&p->empty, b);
+        p->empty_count--;
+        p->nursery = b;
+        return;
+    }
+
+    struct lalloc_block* best = NULL;
+    for (struct lalloc_block* it = p->old; it; it = it->next) {
+        if (!best || it->live < best->live) {
+            best = it;
+        }
+    }
+    if (best && LALLOC_RECYCLE_RATIO * (best->capacity - best->live) >=
+                    best->capacity) {
+        lalloc_unlink(&p->old, best);
+        p->nursery = best;
+        return;
+    }
+
+    p->nursery = lalloc_block_new(p);
+}
+
+/* An old block has no live object left */
+static void
+lalloc_retire(struct lalloc_pool* p, struct lalloc_block* b) {
+    lalloc_unlink(&p->old, b);
+    if (p->empty_count >= LALLOC_EMPTY_RESERVE) {
+        lalloc_block_unmap(b);
+        p->blocks_unmapped++;
+        return;
+    }
+    lalloc_block_reset(b);
+    lalloc_push(&p->empty, b);
+    p->empty_count++;
+}
+
+void*
+lalloc(int kind) {
+    struct lalloc_pool* p = &lalloc_pools[kind];
+
+    for (;;) {
+        struct lalloc_block* b = p->nursery;
+        void* obj = b->free_list;
+        if (obj) {
+            b->free_list = *(void**)obj;
+        } else if (b->bump < b->end) {
+            obj = b->bump;
+            b->bump += p->size;
+        } else {
+            lalloc_promote(p);
+            continue;
+        }
+
+        b->live++;
+        p->allocs++;
+        if (++p->live > p->peak_live) {
+            p->peak_live = p->live;
+        }
+        return obj;
+    }
+}
+
+static void
+lalloc_foreach_block(struct lalloc_block* b, void (*visit)(void*, void*),
+                     void* ctx) {
+    for (char* slot = b->start; slot < b->bump; slot += b->pool->size) {
+        visit(slot, ctx);
+    }
+}
+
+void
+lalloc_foreach(int kind, void (*visit)(void* slot, void* ctx), void* ctx) {
+    struct lalloc_pool* p = &lalloc_pools[kind];
+    lalloc_foreach_block(p->nursery, visit, ctx);
+    for (struct lalloc_block* b = p->old; b; b = b->next) {
+        lalloc_foreach_block(b, visit, ctx);
+    }
+}
+
+void
+lfree(void* obj) {
+    struct lalloc_block* b = (struct lalloc_block*)((uintptr_t)obj &
+                                                    ~(uintptr_t)(LALLOC_BLOCK_SIZE - 1));
+    struct lalloc_pool* p = b->pool;
+    assert(p >= lalloc_pools && p < lalloc_pools + LALLOC_KINDS);
+    b->live--;
+    p->frees++;
+    p->live--;
+
+    if (b == p->nursery) {
+        if (b->live == 0) {
+            /* Every young object died : start over from the beginning */
+            lalloc_block_reset(b);
+            p->resets++;
+        } else {
+            *(void**)obj = b->free_list;
+            b->free_list = obj;
+        }
+        return;
+    }
+
+    if (b->live == 0) {
+        lalloc_retire(p, b);
+        return;
+    }
+
+    *(void**)obj = b->free_list;
+    b->free_list = obj;
+}
+
+void
+lalloc_print_stats(void) {
+    for (int i = 0; i < LALLOC_KINDS; ++i) {
+        struct lalloc_pool* p = &lalloc_pools[i];
+        fprintf(stderr,
+                "ALLOC %s : %lu allocations, %lu frees, %lu live, %lu peak\n"
+                "ALLOC %s : %lu nursery resets, %lu promotions, "
+                "%lu blocks mapped, %lu unmapped\n",
+                p->name, p->allocs, p->frees, p->live, p->peak_live, p->name,
+                p->resets, p->promotions, p->blocks_mapped, p->blocks_unmapped);
+    }
+}
+
+static void
+lalloc_unmap_list(struct lalloc_block* b) {
+    while (b) {
+        struct lalloc_block* next = b->next;
+        lalloc_block_unmap(b);
+        b = next;
+    }
+}
+
+void
+lalloc_cleanup(void) {
+    if (lalloc_stats) {
+        lalloc_print_stats();
+    }
+
+    for (int i = 0; i < LALLOC_KINDS; ++i) {
+        struct lalloc_pool* p = &lalloc_pools[i];
+        lalloc_block_unmap(p->nursery);
+        lalloc_unmap_list(p->old);
+        lalloc_unmap_list(p->empty);
+        *p = (struct lalloc_pool){0};
+    }
+}
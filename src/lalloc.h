@@ -0,0 +1,54 @@
+#ifndef LALLOC_H_
+#define LALLOC_H_
+
+/** Slab allocator for the fixed size objects of the evaluator
+ *
+ * Every kind of object (lval, lenv) has its own pool of 64 KiB blocks mapped
+ * from the OS. New objects are allocated in the nursery block, first from its
+ * free list of dead slots, then by bumping a pointer. Most evaluation
+ * temporaries die before the nursery is full : when all of its objects are
+ * dead, the bump pointer is simply reset to the start of the block.
+ *
+ * When the nursery is full, the block is promoted to the old space with the
+ * objects that survived. Objects are never moved, since lvals are referenced
+ * by raw pointers everywhere : promotion retires the whole block. The next
+ * nursery is an empty block if there is one, otherwise the old block with the
+ * most free slots, or a new block. Old blocks whose objects all died become
+ * empty blocks again, and are unmapped once a few of them are kept in reserve.
+ *
+ * The pools are thread local : each thread calls lalloc_init, and an object
+ * must be freed by the thread that allocated it.
+ *
+ * The collector (see lgc.h) keeps a header in front of every object, and finds
+ * its objects by walking the slots of the pools.
+ *
+ * Setting the LISPY_ALLOC_STATS environment variable prints the allocation
+ * counts of every pool on stderr in lalloc_cleanup.
+ */
+
+#include <stddef.h>
+
+enum { LALLOC_LVAL, LALLOC_LENV, LALLOC_KINDS };
+
+/* Create the nursery of every kind of object for the calling thread. Every
+ * slot has room for header bytes in front of the object, lalloc and lfree
+ * then work on whole slots */
+void lalloc_init(size_t header);
+
+/* Allocate an object of the given kind */
+void* lalloc(int kind);
+
+/* Call visit on every slot of the given kind handed out so far, the freed ones
+ * included : the caller tells them apart. visit must not allocate or free */
+void lalloc_foreach(int kind, void (*visit)(void* slot, void* ctx), void* ctx);
+
+/* Free an object allocated by lalloc */
+void lfree(void* obj);
+
+/* Print the allocation counts on stderr */
+void lalloc_print_stats(void);
+
+/* Give all the blocks of the calling thread back to the OS */
+void lalloc_cleanup(void);
+
+#endif /* LALLOC_H_ */
@@ -0,0 +1,536 @@
+#include "lbig.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define LBIG_BASE ((uint64_t)1 << 32)
+
+/* Largest power of 10 in a limb, used to convert from and to decimal */
+#define LBIG_DECIMAL_BASE 1000000000
+#define LBIG_DECIMAL_DIGITS 9
+
+static struct lbig* lbig_alloc(int count);
+static struct lbig* lbig_trim(struct lbig* a);
+static struct lbig* lbig_add_signed(const struct lbig* a, const struct lbig* b,
+                                    bool b_negative);
+static struct lbig* lbig_mul_with(const struct lbig* a, const struct lbig* b,
+                                  bool karatsuba);
+
+/* Operations on magnitudes : arrays of limbs, least significant first */
+static int mag_trim(const uint32_t* a, int n);
+static int mag_cmp(const uint32_t* a, int an, const uint32_t* b, int bn);
+static uint32_t mag_add_into(uint32_t* r, int rn, const uint32_t* a, int an);
+static void mag_sub_into(uint32_t* r, int rn, const uint32_t* a, int an);
+static void mag_mul_schoolbook(uint32_t* r, const uint32_t* a, int an,
+                               const uint32_t* b, int bn);
+static void mag_mul_karatsuba(uint32_t* r, const uint32_t* a, int an,
+                              const uint32_t* b, int bn);
+static uint32_t mag_divmod_small(uint32_t* q, const uint32_t* a, int an,
+                                 uint32_t d);
+static void mag_divmod(uint32_t* q, uint32_t* r, const uint32_t* u, int un,
+                       const uint32_t* v, int vn);
+
+static struct lbig*
+lbig_alloc(int count) {
+    struct lbig* a = malloc(sizeof(struct lbig) + count * sizeof(uint32_t));
+    assert(a);
+    a->negative = false;
+    a->count = count;
+    return a;
+}
+
+/* Remove the leading zero limbs, zero is never negative */
+static struct lbig*
+lbig_trim(struct lbig* a) {
+    a->count = mag_trim(a->limbs, a->count);
+    if (a->count == 0) {
+        a->negative = false;
+    }
+    return a;
+}
+
+struct lbig*
+lbig_from_int(int64_t x) {
+    uint64_t mag = x < 0 ? -(uint64_t)x : (uint64_t)x;
+    struct lbig* a = lbig_alloc(2);
+    a->limbs[0] = (uint32_t)mag;
+    a->limbs[1] = (uint32_t)(mag >> 32);
+    a->negative = (x < 0);
+    return lbig_trim(a);
+}
+
+struct lbig*
+lbig_from_double(double x) {
+    bool negative = (x < 0);
+    double mag = negative ? -x : x;
+
+    /* Scaling by the base is exact, so are the limbs taken from the top */
+    int count = 1;
+    while (mag >= (double)LBIG_BASE) {
+        mag /= (double)LBIG_BASE;
+        count++;
+    }
+    struct lbig* a = lbig_alloc(count);
+    for (int i = count - 1; i >= 0; --i) {
+        a->limbs[i] = (uint32_t)mag;
+        mag = (mag - a->limbs[i]) * (double)LBIG_BASE;
+    }
+    a->negative = negative;
+    return lbig_trim(a);
+}
+
+struct lbig*
+lbig_from_string(const char* s) {
+    bool negative = (*s == '-');
+    if (*s == '-' || *s == '+') {
+        s++;
+    }
+
+    /* Each group of 9 digits needs less than 32 bits */
+    struct lbig* a = lbig_alloc(strlen(s) / LBIG_DECIMAL_DIGITS + 2);
+    a->count = 0;
+
+    uint32_t chunk = 0;
+    uint32_t scale = 1;
+    for (;; ++s) {
+        bool digit = (*s >= '0' && *s <= '9');
+        if (digit) {
+            chunk = chunk * 10 + (*s - '0');
+            scale *= 10;
+        }
+        if (scale == LBIG_DECIMAL_BASE || (!digit && scale > 1)) {
+            /* a = a * scale + chunk */
+            uint64_t carry = chunk;
+            for (int i = 0; i < a->count; ++i) {
+                uint64_t t = (uint64_t)a->limbs[i] * scale + carry;
+                a->limbs[i] = (uint32_t)t;
+                carry = t >> 32;
+            }
+            if (carry) {
+                a->limbs[a->count++] = (uint32_t)carry;
+            }
+            chunk = 0;
+            scale = 1;
+        }
+        if (!digit) {
+            break;
+        }
+    }
+
+    a->negative = negative;
+    return lbig_trim(a);
+}
+
+bool
+lbig_to_int(const struct lbig* a, int64_t* x) {
+    if (a->count > 2) {
+        return false;
+    }
+    uint64_t mag = 0;
+    for (int i = a->count - 1; i >= 0; --i) {
+        mag = (mag << 32) | a->limbs[i];
+    }
+
+    if (!a->negative) {
+        if (mag > INT64_MAX) {
+            return false;
+        }
+        *x = (int64_t)mag;
+        return true;
+    }
+    if (mag > (uint64_t)INT64_MAX + 1) {
+        return false;
+    }
+    *x = (mag == (uint64_t)INT64_MAX + 1) ? INT64_MIN : -(int64_t)mag;
+    return true;
+}
+
+double
+lbig_to_double(const struct lbig* a) {
+    double x = 0;
+    for (int i = a->count - 1; i >= 0; --i) {
+        x = x * (double)LBIG_BASE + a->limbs[i];
+    }
+    return a->negative ? -x : x;
+}
+
+char*
+lbig_to_string(const struct lbig* a) {
+    if (a->count == 0) {
+        return strdup("0");
+    }
+
+    /* Split the magnitude in groups of 9 digits, least significant first */
+    uint32_t* mag = malloc(a->count * sizeof(uint32_t));
+    uint32_t* groups = malloc((2 * a->count + 1) * sizeof(uint32_t));
+    assert(mag && groups);
+    memcpy(mag, a->limbs, a->count * sizeof(uint32_t));
+    int n = a->count;
+    int count = 0;
+    while (n > 0) {
+        groups[count++] = mag_divmod_small(mag, mag, n, LBIG_DECIMAL_BASE);
+        n = mag_trim(mag, n);
+    }
+
+    char* s = malloc(count * LBIG_DECIMAL_DIGITS + 2);
+    assert(s);
+    char* it = s;
+    if (a->negative) {
+        *it++ = '-';
+    }
+    it += sprintf(it, "%u", groups[count - 1]);
+    for (int i = count - 2; i >= 0; --i) {
+        it += sprintf(it, "%09u", groups[i]);
+    }
+
+    free(mag);
+    free(groups);
+    return s;
+}
+
+struct lbig*
+lbig_copy(const struct lbig* a) {
+    struct lbig* x = lbig_alloc(a->count);
+    x->negative = a->negative;
+    memcpy(x->limbs, a->limbs, a->count * sizeof(uint32_t));
+    return x;
+}
+
+void
+lbig_del(struct lbig* a) {
+    free(a);
+}
+
+size_t
+lbig_bytes(const struct lbig* a) {
+    return sizeof(struct lbig) + a->count * sizeof(uint32_t);
+}
+
+int
+lbig_cmp(const struct lbig* a, const struct lbig* b) {
+    if (a->negative != b->negative) {
+        return a->negative ? -1 : 1;
+    }
+    int c = mag_cmp(a->limbs, a->count, b->limbs, b->count);
+    return a->negative ? -c : c;
+}
+
+struct lbig*
+lbig_neg(const struct lbig* a) {
+    struct lbig* x = lbig_copy(a);
+    x->negative = (a->count > 0) && !a->negative;
+    return x;
+}
+
+/* a + b, where b has the sign b_negative */
+static struct lbig*
+lbig_add_signed(const struct lbig* a, const struct lbig* b, bool b_negative) {
+    if (a->negative == b_negative) {
+        const struct lbig* big = a->count >= b->count ? a : b;
+        const struct lbig* small = a->count >= b->count ? b : a;
+        struct lbig* r = lbig_alloc(big->count + 1);
+        memcpy(r->limbs, big->limbs, big->count * sizeof(uint32_t));
+        r->limbs[big->count] = 0;
+        mag_add_into(r->limbs, r->count, small->limbs, small->count);
+        r->negative = a->negative;
+        return lbig_trim(r);
+    }
+
+    /* Signs differ : subtract the smaller magnitude from the larger one */
+    int c = mag_cmp(a->limbs, a->count, b->limbs, b->count);
+    if (c == 0) {
+        return lbig_alloc(0);
+    }
+    const struct lbig* big = c > 0 ? a : b;
+    const struct lbig* small = c > 0 ? b : a;
+    struct lbig* r = lbig_copy(big);
+    mag_sub_into(r->limbs, r->count, small->limbs, small->count);
+    r->negative = c > 0 ? a->negative : b_negative;
+    return lbig_trim(r);
+}
+
+struct lbig*
+lbig_add(const struct lbig* a, const struct lbig* b) {
+    return lbig_add_signed(a, b, b->negative);
+}
+
+struct lbig*
+lbig_sub(const struct lbig* a, const struct lbig* b) {
+    return lbig_add_signed(a, b, !b->negative);
+}
+
+static struct lbig*
+lbig_mul_with(const struct lbig* a, const struct lbig* b, bool karatsuba) {
+    if (a->count == 0 || b->count == 0) {
+        return lbig_alloc(0);
+    }
+    struct lbig* r = lbig_alloc(a->count + b->count);
+    if (karatsuba) {
+        mag_mul_karatsuba(r->limbs, a->limbs, a->count, b->limbs, b->count);
+    } else {
+        mag_mul_schoolbook(r->limbs, a->limbs, a->count, b->limbs, b->count);
+    }
+    r->negative = (a->negative != b->negative);
+    return lbig_trim(r);
+}
+
+struct lbig*
+lbig_mul(const struct lbig* a, const struct lbig* b) {
+    bool small = a->count < LBIG_KARATSUBA_THRESHOLD ||
+                 b->count < LBIG_KARATSUBA_THRESHOLD;
+    return lbig_mul_with(a, b, !small);
+}
+
+struct lbig*
+lbig_mul_schoolbook(const struct lbig* a, const struct lbig* b) {
+    return lbig_mul_with(a, b, false);
+}
+
+struct lbig*
+lbig_mul_karatsuba(const struct lbig* a, const struct lbig* b) {
+    return lbig_mul_with(a, b, true);
+}
+
+bool
+lbig_divmod(const struct lbig* a, const struct lbig* b, struct lbig** q,
+            struct lbig** r) {
+    if (b->count == 0) {
+        return false;
+    }
+    if (mag_cmp(a->limbs, a->count, b->limbs, b->count) < 0) {
+        *q = lbig_alloc(0);
+        *r = lbig_copy(a);
+        return true;
+    }
+
+    struct lbig* quotient = lbig_alloc(a->count - b->count + 1);
+    struct lbig* remainder = lbig_alloc(b->count);
+    if (b->count == 1) {
+        remainder->limbs[0] = mag_divmod_small(quotient->limbs, a->limbs,
+                                               a->count, b->limbs[0]);
+    } else {
+        mag_divmod(quotient->limbs, remainder->limbs, a->limbs, a->count,
+                   b->limbs, b->count);
+    }
+    quotient->negative = (a->negative != b->negative);
+    remainder->negative = a->negative;
+    *q = lbig_trim(quotient);
+    *r = lbig_trim(remainder);
+    return true;
+}
+
+static int
+mag_trim(const uint32_t* a, int n) {
+    while (n > 0 && a[n - 1] == 0) {
+        n--;
+    }
+    return n;
+}
+
+/* Both magnitudes are trimmed */
+static int
+mag_cmp(const uint32_t* a, int an, const uint32_t* b, int bn) {
+    if (an != bn) {
+        return an < bn ? -1 : 1;
+    }
+    for (int i = an - 1; i >= 0; --i) {
+        if (a[i] != b[i]) {
+            return a[i] < b[i] ? -1 : 1;
+        }
+    }
+    return 0;
+}
+
+/* r += a, with an <= rn. Return the carry out of r */
+static uint32_t
+mag_add_into(uint32_t* r, int rn, const uint32_t* a, int an) {
+    uint64_t carry = 0;
+    int i = 0;
+    for (; i < an; ++i) {
+        uint64_t t = (uint64_t)r[i] + a[i] + carry;
+        r[i] = (uint32_t)t;
+        carry = t >> 32;
+    }
+    for (; carry && i < rn; ++i) {
+        uint64_t t = (uint64_t)r[i] + carry;
+        r[i] = (uint32_t)t;
+        carry = t >> 32;
+    }
+    return (uint32_t)carry;
+}
+
+/* r -= a, where the value of r is at least the value of a */
+static void
+mag_sub_into(uint32_t* r, int rn, const uint32_t* a, int an) {
+    int64_t borrow = 0;
+    int i = 0;
+    for (; i < an; ++i) {
+        int64_t t = (int64_t)r[i] - a[i] - borrow;
+        r[i] = (uint32_t)t;
+        borrow = (t < 0);
+    }
+    for (; borrow && i < rn; ++i) {
+        int64_t t = (int64_t)r[i] - borrow;
+        r[i] = (uint32_t)t;
+        borrow = (t < 0);
+    }
+}
+
+/* r = a * b, r has an + bn limbs */
+static void
+mag_mul_schoolbook(uint32_t* r, const uint32_t* a, int an, const uint32_t* b,
+                   int bn) {
+    memset(r, 0, (an + bn) * sizeof(uint32_t));
+    for (int i = 0; i < an; ++i) {
+        uint64_t carry = 0;
+        for (int j = 0; j < bn; ++j) {
+            uint64_t t = (uint64_t)a[i] * b[j] + r[i + j] + carry;
+            r[i + j] = (uint32_t)t;
+            carry = t >> 32;
+        }
+        r[i + bn] = (uint32_t)carry;
+    }
+}
+
+/* r = a * b, r has an + bn limbs.
+ * With a = a1 B^m + a0 and b = b1 B^m + b0 :
+ * a b = a1 b1 B^2m + ((a0 + a1)(b0 + b1) - a0 b0 - a1 b1) B^m + a0 b0 */
+static void
+mag_mul_karatsuba(uint32_t* r, const uint32_t* a, int an, const uint32_t* b,
+                  int bn) {
+    if (an < bn) {
+        const uint32_t* t = a;
+        a = b;
+        b = t;
+        int tn = an;
+        an = bn;
+        bn = tn;
+    }
+    if (bn < LBIG_KARATSUBA_THRESHOLD) {
+        mag_mul_schoolbook(r, a, an, b, bn);
+        return;
+    }
+
+    int m = an / 2;
+    int rn = an + bn;
+
+    if (bn <= m) {
+        /* b is too short to be split : a b = a1 b B^m + a0 b */
+        uint32_t* high = malloc((an - m + bn) * sizeof(uint32_t));
+        assert(high);
+        memset(r, 0, rn * sizeof(uint32_t));
+        mag_mul_karatsuba(r, a, m, b, bn);
+        mag_mul_karatsuba(high, a + m, an - m, b, bn);
+        mag_add_into(r + m, rn - m, high, an - m + bn);
+        free(high);
+        return;
+    }
+
+    int a1n = an - m;
+    int b1n = bn - m;
+
+    /* z0 = a0 b0 in the low half of r, z2 = a1 b1 in the high half */
+    mag_mul_karatsuba(r, a, m, b, m);
+    mag_mul_karatsuba(r + 2 * m, a + m, a1n, b + m, b1n);
+
+    /* z1 = (a0 + a1)(b0 + b1) - z0 - z2 */
+    int san = (a1n > m ? a1n : m) + 1;
+    int sbn = (b1n > m ? b1n : m) + 1;
+    uint32_t* sa = calloc(san + sbn + san + sbn, sizeof(uint32_t));
+    assert(sa);
+    uint32_t* sb = sa + san;
+    uint32_t* z1 = sb + sbn;
+    memcpy(sa, a, m * sizeof(uint32_t));
+    mag_add_into(sa, san, a + m, a1n);
+    memcpy(sb, b, m * sizeof(uint32_t));
+    mag_add_into(sb, sbn, b + m, b1n);
+
+    mag_mul_karatsuba(z1, sa, san, sb, sbn);
+    mag_sub_into(z1, san + sbn, r, 2 * m);
+    mag_sub_into(z1, san + sbn, r + 2 * m, rn - 2 * m);
+
+    mag_add_into(r + m, rn - m, z1, mag_trim(z1, san + sbn));
+    free(sa);
+}
+
+/* q = a / d, return a % d. q can be a */
+static uint32_t
+mag_divmod_small(uint32_t* q, const uint32_t* a, int an, uint32_t d) {
+    uint64_t rem = 0;
+    for (int i = an - 1; i >= 0; --i) {
+        uint64_t cur = (rem << 32) | a[i];
+        q[i] = (uint32_t)(cur / d);
+        rem = cur % d;
+    }
+    return (uint32_t)rem;
+}
+
+/* Knuth's algorithm D : q = u / v and r = u % v, with un >= vn >= 2.
+ * q has un - vn + 1 limbs and r has vn limbs */
+static void
+mag_divmod(uint32_t* q, uint32_t* r, const uint32_t* u, int un,
+           const uint32_t* v, int vn) {
+    /* Normalize so that the top limb of v has its high bit set */
+    int s = __builtin_clz(v[vn - 1]);
+    uint32_t* vs = malloc(vn * sizeof(uint32_t));
+    uint32_t* us = malloc((un + 1) * sizeof(uint32_t));
+    assert(vs && us);
+    for (int i = vn - 1; i > 0; --i) {
+        vs[i] = (uint32_t)(((uint64_t)v[i] << s) | ((uint64_t)v[i - 1] >> (32 - s)));
+    }
+    vs[0] = v[0] << s;
+    us[un] = (uint32_t)((uint64_t)u[un - 1] >> (32 - s));
+    for (int i = un - 1; i > 0; --i) {
+        us[i] = (uint32_t)(((uint64_t)u[i] << s) | ((uint64_t)u[i - 1] >> (32 - s)));
+    }
+    us[0] = u[0] << s;
+
+    for (int j = un - vn; j >= 0; --j) {
+        /* Estimate the quotient digit from the top limbs */
+        uint64_t num = ((uint64_t)us[j + vn] << 32) | us[j + vn - 1];
+        uint64_t qhat = num / vs[vn - 1];
+        uint64_t rhat = num % vs[vn - 1];
+        while (qhat >= LBIG_BASE ||
+               qhat * vs[vn - 2] > ((rhat << 32) | us[j + vn - 2])) {
+            qhat--;
+            rhat += vs[vn - 1];
+            if (rhat >= LBIG_BASE) {
+                break;
+            }
+        }
+
+        /* Multiply and subtract */
+        int64_t borrow = 0;
+        int64_t t;
+        for (int i = 0; i < vn; ++i) {
+            uint64_t p = qhat * vs[i];
+            t = (int64_t)us[i + j] - borrow - (int64_t)(p & 0xffffffff);
+            us[i + j] = (uint32_t)t;
+            borrow = (int64_t)(p >> 32) - (t >> 32);
+        }
+        t = (int64_t)us[j + vn] - borrow;
+        us[j + vn] = (uint32_t)t;
+
+        /* The estimate was one too large : add v back */
+        q[j] = (uint32_t)qhat;
+        if (t < 0) {
+            q[j]--;
+            uint64_t carry = 0;
+            for (int i = 0; i < vn; ++i) {
+                uint64_t sum = (uint64_t)us[i + j] + vs[i] + carry;
+                us[i + j] = (uint32_t)sum;
+                carry = sum >> 32;
+            }
+            us[j + vn] += (uint32_t)carry;
+        }
+    }
+
+    /* Unnormalize the remainder */
+    for (int i = 0; i < vn; ++i) {
+        r[i] = (uint32_t)(((uint64_t)us[i] >> s) | ((uint64_t)us[i + 1] << (32 - s)));
+    }
+
+    free(vs);
+    free(us);
+}
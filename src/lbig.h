@@ -0,0 +1,71 @@
+#ifndef LBIG_H_
+#define LBIG_H_
+
+/** Arbitrary precision integers
+ *
+ * A struct lbig is a sign and a magnitude stored as 32 bits limbs, least
+ * significant first, without leading zero limbs (zero has no limb). Values
+ * are immutable : every operation returns a new lbig, freed with lbig_del.
+ *
+ * Integers start as int64 (LVAL_INT), and only become LVAL_BIG when an
+ * operation overflows, see builtin_op in evaluation.c.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct lbig {
+    bool negative;
+    int count;
+    uint32_t limbs[];
+};
+
+/* Operands with fewer limbs are multiplied with the schoolbook algorithm */
+#define LBIG_KARATSUBA_THRESHOLD 32
+
+struct lbig* lbig_from_int(int64_t x);
+
+/* Integer part of x, which must be finite */
+struct lbig* lbig_from_double(double x);
+
+/* Parse a decimal integer with an optional leading '-' */
+struct lbig* lbig_from_string(const char* s);
+
+/* Store the value of a in x if it fits in an int64 */
+bool lbig_to_int(const struct lbig* a, int64_t* x);
+
+double lbig_to_double(const struct lbig* a);
+
+/* Return a decimal representation of a, to be freed by the caller */
+char* lbig_to_string(const struct lbig* a);
+
+struct lbig* lbig_copy(const struct lbig* a);
+
+void lbig_del(struct lbig* a);
+
+/* Bytes used by a */
+size_t lbig_bytes(const struct lbig* a);
+
+/* Return -1, 0 or 1 when a is lower, equal or greater than b */
+int lbig_cmp(const struct lbig* a, const struct lbig* b);
+
+struct lbig* lbig_neg(const struct lbig* a);
+
+struct lbig* lbig_add(const struct lbig* a, const struct lbig* b);
+
+struct lbig* lbig_sub(const struct lbig* a, const struct lbig* b);
+
+/* Multiply with Karatsuba above LBIG_KARATSUBA_THRESHOLD limbs */
+struct lbig* lbig_mul(const struct lbig* a, const struct lbig* b);
+
+/* Multiplication algorithms, exposed for bench/lbig_bench.c */
+struct lbig* lbig_mul_schoolbook(const struct lbig* a, const struct lbig* b);
+struct lbig* lbig_mul_karatsuba(const struct lbig* a, const struct lbig* b);
+
+/* Truncated division : the remainder has the sign of a.
+ * Return false if b is zero */
+bool lbig_divmod(const struct lbig* a, const struct lbig* b, struct lbig** q,
+                 struct lbig** r);
+
+#endif /* LBIG_H_ */
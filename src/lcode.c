@@ -0,0 +1,994 @@
+#include "lcode.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "evaluation.h"
+#include "lenv.h"
+#include "lsym.h"
+
+/* Builtins replaced by a dedicated opcode when called with two arguments */
+static const struct {
+    lbuiltin builtin;
+    int op;
+} lcode_binary_ops[] = {
+    {builtin_add, LOP_ADD}, {builtin_sub, LOP_SUB}, {builtin_mul, LOP_MUL},
+    {builtin_div, LOP_DIV}, {builtin_mod, LOP_MOD}, {builtin_eq, LOP_EQ},
+    {builtin_ne, LOP_NE},   {builtin_gt, LOP_GT},   {builtin_ge, LOP_GE},
+    {builtin_lt, LOP_LT},   {builtin_le, LOP_LE},
+};
+
+/* Builtins without side effects, whose calls on constants are folded */
+static const lbuiltin lcode_pure_builtins[] = {
+    builtin_add, builtin_sub, builtin_mul, builtin_div, builtin_mod,
+    builtin_eq,  builtin_ne,  builtin_gt,  builtin_ge,  builtin_lt,
+    builtin_le,  builtin_not, builtin_or,  builtin_and, builtin_len,
+    builtin_head, builtin_tail,
+};
+
+static const char* lcode_op_names[LOP_COUNT] = {
+    [LOP_CONST] = "CONST",
+    [LOP_LOCAL] = "LOCAL",
+    [LOP_CAPTURED] = "CAPTURED",
+    [LOP_GLOBAL] = "GLOBAL",
+    [LOP_CALL] = "CALL",
+    [LOP_TAIL_CALL] = "TAIL_CALL",
+    [LOP_BUILTIN] = "BUILTIN",
+    [LOP_EVAL] = "EVAL",
+    [LOP_TAIL_EVAL] = "TAIL_EVAL",
+    [LOP_EVAL_HEAD] = "EVAL_HEAD",
+    [LOP_TAIL_EVAL_HEAD] = "TAIL_EVAL_HEAD",
+    [LOP_FOLDED] = "FOLDED",
+    [LOP_JUMP] = "JUMP",
+    [LOP_JUMP_IF_FALSE] = "JUMP_IF_FALSE",
+    [LOP_DROP] = "DROP",
+    [LOP_ADD] = "ADD",
+    [LOP_SUB] = "SUB",
+    [LOP_MUL] = "MUL",
+    [LOP_DIV] = "DIV",
+    [LOP_MOD] = "MOD",
+    [LOP_EQ] = "EQ",
+    [LOP_NE] = "NE",
+    [LOP_GT] = "GT",
+    [LOP_GE] = "GE",
+    [LOP_LT] = "LT",
+    [LOP_LE] = "LE",
+    [LOP_RETURN] = "RETURN",
+    [LOP_BINARY_LOCAL_CONST] = "BINARY_LOCAL_CONST",
+    [LOP_BINARY_JUMP] = "BINARY_JUMP",
+    [LOP_BINARY_LOCAL_CONST_JUMP] = "BINARY_LOCAL_CONST_JUMP",
+};
+
+/* Set by LISPY_ESCAPE_DUMP : print the escape analysis of every body */
+static bool lcode_dump_escapes;
+
+/* Call of a builtin allocating its result, found by the escape analysis */
+struct lcode_site {
+    /* The S-expression of the call */
+    struct lval* expr;
+    /* True if the result can outlive the expression using it */
+    bool escapes;
+    /* True if the result is a temporary that the code does not allocate */
+    bool elided;
+};
+
+struct lcompiler {
+    /* Environment where the lambda is created, to find the builtins */
+    struct lenv* env;
+    struct lval* formals;
+    /* Symbols of the closure, or NULL */
+    struct lval* closure_names;
+    /* The code is run in other frames than e, see lcode_compile_eval */
+    bool any_frame;
+    struct lcode* code;
+
+    /* Allocated sizes of the arrays of code */
+    int ops_size;
+    int consts_size;
+    int builtins_size;
+
+    /* Stack slots used at the current instruction */
+    int depth;
+
+    /* Results of the escape analysis of the body */
+    struct lcode_site* sites;
+    int site_count;
+    int sites_size;
+};
+
+static struct lcode* lcode_body(struct lcompiler* c, struct lval* body);
+static void lcode_emit(struct lcompiler* c, int op);
+static int lcode_label(struct lcompiler* c);
+static void lcode_patch(struct lcompiler* c, int at, int target);
+static int lcode_link(struct lcompiler* c, int at, int list);
+static void lcode_patch_list(struct lcompiler* c, int list, int target);
+static int lcode_const(struct lcompiler* c, struct lval* v);
+static int lcode_builtin(struct lcompiler* c, lbuiltin builtin);
+static void lcode_push(struct lcompiler* c, int n);
+static int lcode_slot(struct lcompiler* c, struct lval* sym);
+static int lcode_captured(struct lcompiler* c, struct lval* sym);
+static struct lval* lcode_find_builtin(struct lcompiler* c, struct lval* sym);
+static void lcode_expr(struct lcompiler* c, struct lval* v, bool tail);
+static void lcode_symbol(struct lcompiler* c, struct lval* sym);
+static void lcode_list(struct lcompiler* c, struct lval** cells, int count,
+                       bool tail);
+static void lcode_call(struct lcompiler* c, struct lval** cells, int count,
+                       bool tail);
+static bool lcode_folded(struct lcompiler* c, struct lval** cells, int count,
+                         bool tail);
+static struct lval* lcode_fold(struct lcompiler* c, struct lval* v,
+                               struct lval* names);
+static struct lval* lcode_fold_list(struct lcompiler* c, struct lval** cells,
+                                    int count, struct lval* names);
+static bool lcode_is_pure(lbuiltin builtin);
+static int lcode_binary_op(struct lcompiler* c, struct lval** cells,
+                           int count);
+static bool lcode_is_local_const(struct lcompiler* c, struct lval** cells);
+static void lcode_binary(struct lcompiler* c, int op, struct lval** cells);
+static int lcode_test(struct lcompiler* c, struct lval* test);
+static void lcode_cond(struct lcompiler* c, struct lval** cells, bool tail);
+static bool lcode_is_select(struct lval** cells, int count);
+static void lcode_select(struct lcompiler* c, struct lval** cells, int count,
+                         bool tail);
+static void lcode_do(struct lcompiler* c, struct lval** cells, int count,
+                     bool tail);
+static void lcode_eval(struct lcompiler* c, struct lval** cells, int count,
+                       bool tail);
+static bool lcode_eval_head(struct lcompiler* c, struct lval* arg, bool tail);
+static bool lcode_calls(struct lcompiler* c, struct lval* v,
+                        lbuiltin builtin);
+static bool lcode_allocates(lbuiltin builtin);
+static bool lcode_keeps_arg(lbuiltin builtin, int i);
+static void lcode_escape(struct lcompiler* c, struct lval* v, bool escapes);
+static void lcode_escape_list(struct lcompiler* c, struct lval* v,
+                              struct lval** cells, int count, bool escapes);
+static struct lcode_site* lcode_site(struct lcompiler* c, struct lval* expr);
+static void lcode_print_sites(struct lcompiler* c, struct lval* body);
+
+void
+lcode_init(void) {
+    lcode_dump_escapes = (getenv("LISPY_ESCAPE_DUMP") != NULL);
+}
+
+struct lcode*
+lcode_compile(struct lenv* e, struct lval* formals, struct lval* closure_names,
+              struct lval* body) {
+    struct lcompiler c = {
+        .env = e, .formals = formals, .closure_names = closure_names};
+    return lcode_body(&c, body);
+}
+
+struct lcode*
+lcode_compile_eval(struct lenv* e, struct lval* x) {
+    if (!x->eval_code) {
+        /* Immortal : the reference is not needed */
+        struct lval* formals = lval_nil();
+        lval_del(formals);
+        struct lcompiler c = {.env = e, .formals = formals, .any_frame = true};
+        x->eval_code = lcode_body(&c, x);
+    }
+    return lcode_ref(x->eval_code);
+}
+
+/* Compile body with the compiler c, which has no code yet */
+static struct lcode*
+lcode_body(struct lcompiler* c, struct lval* body) {
+    c->code = calloc(1, sizeof(struct lcode));
+    assert(c->code);
+    c->code->refcount = 1;
+
+    /* The body is a Q-expression evaluated as a S-expression */
+    lcode_escape_list(c, body, body->cell, body->count, true);
+    lcode_list(c, body->cell, body->count, true);
+    if (lcode_dump_escapes) {
+        lcode_print_sites(c, body);
+    }
+    free(c->sites);
+
+    /* Version 0 is never current, so every cache starts empty */
+    c->code->caches = calloc(c->code->cache_count, sizeof(struct lcode_cache));
+    assert(c->code->caches || c->code->cache_count == 0);
+    return c->code;
+}
+
+const char*
+lcode_op_name(int op) {
+    return lcode_op_names[op];
+}
+
+struct lcode*
+lcode_ref(struct lcode* code) {
+    if (code) {
+        code->refcount++;
+    }
+    return code;
+}
+
+void
+lcode_del(struct lcode* code) {
+    if (!code || --code->refcount > 0) {
+        return;
+    }
+    free(code->ops);
+    free(code->consts);
+    free(code->builtins);
+    free(code->caches);
+    free(code);
+}
+
+static void
+lcode_emit(struct lcompiler* c, int op) {
+    struct lcode* code = c->code;
+    if (code->count == c->ops_size) {
+        c->ops_size = c->ops_size ? 2 * c->ops_size : 16;
+        code->ops = realloc(code->ops, c->ops_size * sizeof(int));
+        assert(code->ops);
+    }
+    code->ops[code->count++] = op;
+}
+
+/* Position of the next instruction */
+static int
+lcode_label(struct lcompiler* c) {
+    return c->code->count;
+}
+
+/* Set the jump target emitted at the given position */
+static void
+lcode_patch(struct lcompiler* c, int at, int target) {
+    c->code->ops[at] = target;
+}
+
+/* Add the jump target emitted at the given position to a list of targets to
+ * patch at once, which is chained through the targets themselves. -1 is the
+ * empty list */
+static int
+lcode_link(struct lcompiler* c, int at, int list) {
+    c->code->ops[at] = list;
+    return at;
+}
+
+static void
+lcode_patch_list(struct lcompiler* c, int list, int target) {
+    while (list >= 0) {
+        int next = c->code->ops[list];
+        c->code->ops[list] = target;
+        list = next;
+    }
+}
+
+static int
+lcode_const(struct lcompiler* c, struct lval* v) {
+    struct lcode* code = c->code;
+    for (int i = 0; i < code->const_count; ++i) {
+        if (code->consts[i] == v) {
+            return i;
+        }
+    }
+    if (code->const_count == c->consts_size) {
+        c->consts_size = c->consts_size ? 2 * c->consts_size : 8;
+        code->consts =
+            realloc(code->consts, c->consts_size * sizeof(struct lval*));
+        assert(code->consts);
+    }
+    code->consts[code->const_count] = v;
+    return code->const_count++;
+}
+
+static int
+lcode_builtin(struct lcompiler* c, lbuiltin builtin) {
+    struct lcode* code = c->code;
+    for (int i = 0; i < code->builtin_count; ++i) {
+        if (code->builtins[i] == builtin) {
+            return i;
+        }
+    }
+    if (code->builtin_count == c->builtins_size) {
+        c->builtins_size = c->builtins_size ? 2 * c->builtins_size : 4;
+        code->builtins =
+            realloc(code->builtins, c->builtins_size * sizeof(lbuiltin));
+        assert(code->builtins);
+    }
+    code->builtins[code->builtin_count] = builtin;
+    return code->builtin_count++;
+}
+
+/* Account for n values pushed (or popped if negative) on the stack */
+static void
+lcode_push(struct lcompiler* c, int n) {
+    c->depth += n;
+    if (c->depth > c->code->max_stack) {
+        c->code->max_stack = c->depth;
+    }
+}
+
+/* Position of the formal sym in the slots of the frame, or -1 for the other
+ * symbols. The last one wins when a name is repeated, see lenv_slot */
+static int
+lcode_slot(struct lcompiler* c, struct lval* sym) {
+    for (int i = c->formals->count - 1; i >= 0; --i) {
+        if (c->formals->cell[i] == sym && lval_to_sym(sym) != lsym_amp) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* Position of sym in the closure, or -1 if it is not captured */
+static int
+lcode_captured(struct lcompiler* c, struct lval* sym) {
+    for (int i = 0; c->closure_names && i < c->closure_names->count; ++i) {
+        if (c->closure_names->cell[i] == sym) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* Return the builtin function bound to sym, or NULL. The global environment
+ * keeps it alive, since builtins are never redefined. A name which may be
+ * bound in frames is only resolved when the code runs in e */
+static struct lval*
+lcode_find_builtin(struct lcompiler* c, struct lval* sym) {
+    if (c->any_frame && (*lsym_flags(lval_to_sym(sym)) & LSYM_LOCAL)) {
+        return NULL;
+    }
+    if (!lenv_is_builtin(c->env, sym)) {
+        return NULL;
+    }
+    struct lval* v = lenv_get(c->env, sym);
+    bool builtin = (lval_type(v) == LVAL_FUN);
+    lval_del(v);
+    return builtin ? v : NULL;
+}
+
+/* Compile the evaluation of v. In tail position the code returns the value,
+ * otherwise it leaves it on the stack */
+static void
+lcode_expr(struct lcompiler* c, struct lval* v, bool tail) {
+    switch (lval_type(v)) {
+        case LVAL_SYM:
+            lcode_symbol(c, v);
+            break;
+        case LVAL_SEXPR:
+            lcode_list(c, v->cell, v->count, tail);
+            return;
+        default:
+            /* Other values evaluate to themselves */
+            lcode_emit(c, LOP_CONST);
+            lcode_emit(c, lcode_const(c, v));
+            lcode_push(c, 1);
+            break;
+    }
+    if (tail) {
+        lcode_emit(c, LOP_RETURN);
+        lcode_push(c, -1);
+    }
+}
+
+static void
+lcode_symbol(struct lcompiler* c, struct lval* sym) {
+    char* name = lval_to_sym(sym);
+    struct lval* constant = NULL;
+    if (name == lsym_t || name == lsym_f) {
+        constant = lval_bool(name == lsym_t);
+    } else if (name == lsym_nil) {
+        /* nil is immortal : the reference is not needed */
+        constant = lval_nil();
+        lval_del(constant);
+    } else if (lcode_slot(c, sym) < 0) {
+        constant = lcode_find_builtin(c, sym);
+    }
+
+    if (constant) {
+        lcode_emit(c, LOP_CONST);
+        lcode_emit(c, lcode_const(c, constant));
+    } else if (lcode_slot(c, sym) >= 0) {
+        lcode_emit(c, LOP_LOCAL);
+        lcode_emit(c, lcode_slot(c, sym));
+    } else if (lcode_captured(c, sym) >= 0) {
+        lcode_emit(c, LOP_CAPTURED);
+        lcode_emit(c, lcode_captured(c, sym));
+    } else {
+        lcode_emit(c, LOP_GLOBAL);
+        lcode_emit(c, lcode_const(c, sym));
+        lcode_emit(c, c->code->cache_count++);
+    }
+    lcode_push(c, 1);
+}
+
+/* Compile the evaluation of a S-expression given by its cells */
+static void
+lcode_list(struct lcompiler* c, struct lval** cells, int count, bool tail) {
+    if (count == 0) {
+        /* The empty S-expression is immortal : the reference is not needed */
+        struct lval* unit = lval_unit();
+        lval_del(unit);
+        lcode_emit(c, LOP_CONST);
+        lcode_emit(c, lcode_const(c, unit));
+        lcode_push(c, 1);
+        if (tail) {
+            lcode_emit(c, LOP_RETURN);
+            lcode_push(c, -1);
+        }
+        return;
+    }
+
+    /* A single value is not called */
+    if (count == 1) {
+        lcode_expr(c, cells[0], tail);
+        return;
+    }
+
+    if (!lcode_folded(c, cells, count, tail)) {
+        lcode_call(c, cells, count, tail);
+    }
+}
+
+/* Compile the call made by a S-expression of at least two cells */
+static void
+lcode_call(struct lcompiler* c, struct lval** cells, int count, bool tail) {
+    int op = lcode_binary_op(c, cells, count);
+    if (op >= 0) {
+        lcode_binary(c, op, cells);
+        if (tail) {
+            lcode_emit(c, LOP_RETURN);
+            lcode_push(c, -1);
+        }
+        return;
+    }
+
+    struct lval* builtin = lval_type(cells[0]) == LVAL_SYM
+                               ? lcode_find_builtin(c, cells[0])
+                               : NULL;
+    if (builtin) {
+        if (builtin->builtin == builtin_cond && count == 4) {
+            if (lval_type(cells[2]) == LVAL_QEXPR &&
+                lval_type(cells[3]) == LVAL_QEXPR) {
+                lcode_cond(c, cells, tail);
+            } else {
+                lcode_eval(c, cells, count, tail);
+            }
+            return;
+        }
+        if (builtin->builtin == builtin_eval && count == 2) {
+            if (!lcode_eval_head(c, cells[1], tail)) {
+                lcode_eval(c, cells, count, tail);
+            }
+            return;
+        }
+        if (builtin->builtin == builtin_select &&
+            lcode_is_select(cells, count)) {
+            lcode_select(c, cells, count, tail);
+            return;
+        }
+        if (builtin->builtin == builtin_do) {
+            lcode_do(c, cells, count, tail);
+            return;
+        }
+
+        for (int i = 1; i < count; ++i) {
+            lcode_expr(c, cells[i], false);
+        }
+        lcode_emit(c, LOP_BUILTIN);
+        lcode_emit(c, lcode_builtin(c, builtin->builtin));
+        lcode_emit(c, count - 1);
+        lcode_push(c, 2 - count);
+        if (tail) {
+            lcode_emit(c, LOP_RETURN);
+            lcode_push(c, -1);
+        }
+        return;
+    }
+
+    for (int i = 0; i < count; ++i) {
+        lcode_expr(c, cells[i], false);
+    }
+    lcode_emit(c, tail ? LOP_TAIL_CALL : LOP_CALL);
+    lcode_emit(c, count - 1);
+    lcode_push(c, 1 - count);
+    if (tail) {
+        lcode_push(c, -1);
+    }
+}
+
+/* Compile a call of pure builtins on constants whose value is an immediate,
+ * like (* 60 60 24), as this value. Return false for the other calls */
+static bool
+lcode_folded(struct lcompiler* c, struct lval** cells, int count, bool tail) {
+    struct lval* names = lval_qexpr();
+    struct lval* value = lcode_fold_list(c, cells, count, names);
+    if (!value || !lval_is_imm(value)) {
+        if (value) {
+            lval_del(value);
+        }
+        lval_del(names);
+        return false;
+    }
+
+    if (!names->count) {
+        lcode_emit(c, LOP_CONST);
+        lcode_emit(c, lcode_const(c, value));
+        lcode_push(c, 1);
+    } else {
+        /* The value depends on global constants, which may be redefined : the
+         * code of the call computes it then */
+        lcode_emit(c, LOP_FOLDED);
+        lcode_emit(c, lcode_const(c, value));
+        int end_at = lcode_label(c);
+        lcode_emit(c, 0);
+        lcode_emit(c, names->count);
+        for (int i = 0; i < names->count; ++i) {
+            lcode_emit(c, lcode_const(c, names->cell[i]));
+        }
+        lcode_push(c, 1);
+        lcode_push(c, -1);
+        lcode_call(c, cells, count, false);
+        lcode_patch(c, end_at, lcode_label(c));
+    }
+    lval_del(names);
+    if (tail) {
+        lcode_emit(c, LOP_RETURN);
+        lcode_push(c, -1);
+    }
+    return true;
+}
+
+/* Return a new reference to the value of v if it is a constant, else NULL.
+ * The names of the global constants it uses are added to names */
+static struct lval*
+lcode_fold(struct lcompiler* c, struct lval* v, struct lval* names) {
+    if (lval_type(v) == LVAL_SEXPR) {
+        return lcode_fold_list(c, v->cell, v->count, names);
+    }
+    if (lval_type(v) != LVAL_SYM) {
+        /* Other values evaluate to themselves */
+        return lval_ref(v);
+    }
+
+    char* name = lval_to_sym(v);
+    if (name == lsym_t || name == lsym_f) {
+        return lval_bool(name == lsym_t);
+    }
+    if (name == lsym_nil) {
+        return lval_nil();
+    }
+    if (lcode_slot(c, v) >= 0 || lcode_captured(c, v) >= 0) {
+        return NULL;
+    }
+    /* Names also bound in frames are not global constants, see LSYM_LOCAL */
+    struct lval* value = lenv_global_value(v);
+    if (!value || (*lsym_flags(name) & LSYM_REDEFINED)) {
+        return NULL;
+    }
+    switch (lval_type(value)) {
+        case LVAL_INT:
+        case LVAL_NUM:
+        case LVAL_BIG:
+        case LVAL_BOOL:
+        case LVAL_STR:
+        case LVAL_QEXPR:
+            for (int i = 0; i < names->count; ++i) {
+                if (names->cell[i] == v) {
+                    return lval_ref(value);
+                }
+            }
+            lval_add(names, v);
+            return lval_ref(value);
+        default:
+            return NULL;
+    }
+}
+
+/* Same as lcode_fold for a S-expression given by its cells : its value is
+ * computed if it calls a pure builtin, with arguments which are constants.
+ * Calls giving an error are not folded, so that the code gives it */
+static struct lval*
+lcode_fold_list(struct lcompiler* c, struct lval** cells, int count,
+                struct lval* names) {
+    if (count == 1) {
+        return lcode_fold(c, cells[0], names);
+    }
+    struct lval* builtin = (count > 1 && lval_type(cells[0]) == LVAL_SYM)
+                               ? lcode_find_builtin(c, cells[0])
+                               : NULL;
+    if (!builtin || !lcode_is_pure(builtin->builtin)) {
+        return NULL;
+    }
+
+    struct lval* args = lval_sexpr();
+    for (int i = 1; i < count; ++i) {
+        struct lval* arg = lcode_fold(c, cells[i], names);
+        if (!arg) {
+            lval_del(args);
+            return NULL;
+        }
+        args = lval_add(args, arg);
+    }
+    struct lval* value = builtin->builtin(c->env, args);
+    if (lval_type(value) == LVAL_ERR) {
+        lval_del(value);
+        return NULL;
+    }
+    return value;
+}
+
+static bool
+lcode_is_pure(lbuiltin builtin) {
+    int count = sizeof(lcode_pure_builtins) / sizeof(lcode_pure_builtins[0]);
+    for (int i = 0; i < count; ++i) {
+        if (lcode_pure_builtins[i] == builtin) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Opcode of the binary builtin called by the S-expression, or -1 */
+static int
+lcode_binary_op(struct lcompiler* c, struct lval** cells, int count) {
+    if (count != 3 || lval_type(cells[0]) != LVAL_SYM) {
+        return -1;
+    }
+    struct lval* builtin = lcode_find_builtin(c, cells[0]);
+    if (!builtin) {
+        return -1;
+    }
+    int ops = sizeof(lcode_binary_ops) / sizeof(lcode_binary_ops[0]);
+    for (int i = 0; i < ops; ++i) {
+        if (lcode_binary_ops[i].builtin == builtin->builtin) {
+            return lcode_binary_ops[i].op;
+        }
+    }
+    return -1;
+}
+
+/* True if the arguments of the binary call are a formal and a constant, like
+ * in (- n 1) */
+static bool
+lcode_is_local_const(struct lcompiler* c, struct lval** cells) {
+    int type = lval_type(cells[2]);
+    return lval_type(cells[1]) == LVAL_SYM && lcode_slot(c, cells[1]) >= 0 &&
+           type != LVAL_SYM && type != LVAL_SEXPR;
+}
+
+/* Compile the call of a binary builtin, leaving the result on the stack */
+static void
+lcode_binary(struct lcompiler* c, int op, struct lval** cells) {
+    if (lcode_is_local_const(c, cells)) {
+        lcode_emit(c, LOP_BINARY_LOCAL_CONST);
+        lcode_emit(c, op);
+        lcode_emit(c, lcode_slot(c, cells[1]));
+        lcode_emit(c, lcode_const(c, cells[2]));
+        lcode_push(c, 1);
+        return;
+    }
+    lcode_expr(c, cells[1], false);
+    lcode_expr(c, cells[2], false);
+    lcode_emit(c, op);
+    lcode_push(c, -1);
+}
+
+/* Compile a test followed by a conditional jump, and return the position of
+ * its two targets : where to continue if the test is false, and where to go
+ * with the error when it is not a boolean */
+static int
+lcode_test(struct lcompiler* c, struct lval* test) {
+    int op = lval_type(test) == LVAL_SEXPR
+                 ? lcode_binary_op(c, test->cell, test->count)
+                 : -1;
+    if (op >= 0 && lcode_is_local_const(c, test->cell)) {
+        lcode_emit(c, LOP_BINARY_LOCAL_CONST_JUMP);
+        lcode_emit(c, op);
+        lcode_emit(c, lcode_slot(c, test->cell[1]));
+        lcode_emit(c, lcode_const(c, test->cell[2]));
+        /* Room for the error pushed when the result is not a boolean */
+        lcode_push(c, 1);
+        lcode_push(c, -1);
+    } else if (op >= 0) {
+        lcode_expr(c, test->cell[1], false);
+        lcode_expr(c, test->cell[2], false);
+        lcode_emit(c, LOP_BINARY_JUMP);
+        lcode_emit(c, op);
+        lcode_push(c, -2);
+    } else {
+        lcode_expr(c, test, false);
+        lcode_emit(c, LOP_JUMP_IF_FALSE);
+        lcode_push(c, -1);
+    }
+    int targets = lcode_label(c);
+    lcode_emit(c, 0);
+    lcode_emit(c, 0);
+    return targets;
+}
+
+/* (cond test {then} {else}) : the branches are evaluated in the frame, like
+ * builtin_cond does */
+static void
+lcode_cond(struct lcompiler* c, struct lval** cells, bool tail) {
+    int targets = lcode_test(c, cells[1]);
+
+    lcode_list(c, cells[2]->cell, cells[2]->count, tail);
+    int then_end_at = -1;
+    if (!tail) {
+        lcode_emit(c, LOP_JUMP);
+        then_end_at = lcode_label(c);
+        lcode_emit(c, 0);
+        lcode_push(c, -1);
+    }
+
+    lcode_patch(c, targets, lcode_label(c));
+    lcode_list(c, cells[3]->cell, cells[3]->count, tail);
+
+    /* The error of a test which is not a boolean is the result */
+    lcode_patch(c, targets + 1, lcode_label(c));
+    if (tail) {
+        lcode_push(c, 1);
+        lcode_emit(c, LOP_RETURN);
+        lcode_push(c, -1);
+    } else {
+        lcode_patch(c, then_end_at, lcode_label(c));
+    }
+}
+
+/* True if every clause of the select is a literal {test value} */
+static bool
+lcode_is_select(struct lval** cells, int count) {
+    for (int i = 1; i < count; ++i) {
+        if (lval_type(cells[i]) != LVAL_QEXPR || cells[i]->count != 2) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* (select {test value}...) : a chain of conditional jumps. builtin_select
+ * without clauses gives the error when no test is true */
+static void
+lcode_select(struct lcompiler* c, struct lval** cells, int count, bool tail) {
+    /* Jumps to the end, to patch */
+    int ends = -1;
+
+    for (int i = 1; i < count; ++i) {
+        struct lval* clause = cells[i];
+        int targets = lcode_test(c, clause->cell[0]);
+        ends = lcode_link(c, targets + 1, ends);
+
+        lcode_expr(c, clause->cell[1], tail);
+        if (!tail) {
+            lcode_emit(c, LOP_JUMP);
+            lcode_emit(c, 0);
+            ends = lcode_link(c, lcode_label(c) - 1, ends);
+            lcode_push(c, -1);
+        }
+        lcode_patch(c, targets, lcode_label(c));
+    }
+
+    lcode_emit(c, LOP_BUILTIN);
+    lcode_emit(c, lcode_builtin(c, builtin_select));
+    lcode_emit(c, 0);
+    lcode_push(c, 1);
+
+    lcode_patch_list(c, ends, lcode_label(c));
+    if (tail) {
+        lcode_emit(c, LOP_RETURN);
+        lcode_push(c, -1);
+    }
+}
+
+/* (do x...) with at least one value : the values but the last one are
+ * dropped. Unlike builtin_do, which gets every value, an error stops the
+ * sequence */
+static void
+lcode_do(struct lcompiler* c, struct lval** cells, int count, bool tail) {
+    int ends = -1;
+    for (int i = 1; i < count - 1; ++i) {
+        lcode_expr(c, cells[i], false);
+        lcode_emit(c, LOP_DROP);
+        lcode_emit(c, 0);
+        ends = lcode_link(c, lcode_label(c) - 1, ends);
+        lcode_push(c, -1);
+    }
+    lcode_expr(c, cells[count - 1], tail);
+
+    /* The error stopping the sequence is the result */
+    lcode_patch_list(c, ends, lcode_label(c));
+    if (tail && count > 2) {
+        lcode_push(c, 1);
+        lcode_emit(c, LOP_RETURN);
+        lcode_push(c, -1);
+    }
+}
+
+/* (eval x) or (cond test x y) whose branches are not literal : the Q-expression
+ * is only known when the code runs */
+static void
+lcode_eval(struct lcompiler* c, struct lval** cells, int count, bool tail) {
+    for (int i = 1; i < count; ++i) {
+        lcode_expr(c, cells[i], false);
+    }
+    lcode_emit(c, tail ? LOP_TAIL_EVAL : LOP_EVAL);
+    lcode_emit(c, count - 1);
+    lcode_push(c, 2 - count);
+    if (tail) {
+        lcode_push(c, -1);
+    }
+}
+
+/* (eval (head (tail ... x))) whose lists are temporaries : they are not
+ * allocated, the element of x that head would give is evaluated in place
+ * (see LOP_EVAL_HEAD). Return false for other arguments of eval */
+static bool
+lcode_eval_head(struct lcompiler* c, struct lval* arg, bool tail) {
+    struct lcode_site* head = lcode_site(c, arg);
+    if (!head || head->escapes || !lcode_calls(c, arg, builtin_head)) {
+        return false;
+    }
+    head->elided = true;
+    struct lval* x = arg->cell[1];
+    int tails = 0;
+    struct lcode_site* site = lcode_site(c, x);
+    while (site && !site->escapes && lcode_calls(c, x, builtin_tail)) {
+        site->elided = true;
+        x = x->cell[1];
+        tails++;
+        site = lcode_site(c, x);
+    }
+
+    lcode_expr(c, x, false);
+    lcode_emit(c, tail ? LOP_TAIL_EVAL_HEAD : LOP_EVAL_HEAD);
+    lcode_emit(c, tails);
+    if (tail) {
+        lcode_push(c, -1);
+    }
+    return true;
+}
+
+/* True if v is a call of builtin with one argument */
+static bool
+lcode_calls(struct lcompiler* c, struct lval* v, lbuiltin builtin) {
+    if (lval_type(v) != LVAL_SEXPR || v->count != 2 ||
+        lval_type(v->cell[0]) != LVAL_SYM) {
+        return false;
+    }
+    struct lval* f = lcode_find_builtin(c, v->cell[0]);
+    return f && f->builtin == builtin;
+}
+
+/* True for the builtins returning a list they allocate, the values that the
+ * escape analysis looks for */
+static bool
+lcode_allocates(lbuiltin builtin) {
+    return builtin == builtin_head || builtin == builtin_tail ||
+           builtin == builtin_list || builtin == builtin_join ||
+           builtin == builtin_cons || builtin == builtin_init;
+}
+
+/* True if the argument i (from 1) of builtin can outlive the call : the
+ * builtin returns it, a part of it or a slice sharing its cells, or binds it.
+ * The arguments of the other builtins only live until they return */
+static bool
+lcode_keeps_arg(lbuiltin builtin, int i) {
+    static const lbuiltin readers[] = {
+        builtin_add,  builtin_sub,  builtin_mul,   builtin_div,  builtin_mod,
+        builtin_floor, builtin_not, builtin_or,    builtin_and,  builtin_gt,
+        builtin_ge,   builtin_lt,   builtin_le,    builtin_eq,   builtin_ne,
+        builtin_len,  builtin_head, builtin_eval,  builtin_print,
+        builtin_show,
+    };
+    if (builtin == builtin_cond) {
+        /* Only the test is read */
+        return i != 1;
+    }
+    for (size_t k = 0; k < sizeof(readers) / sizeof(readers[0]); ++k) {
+        if (readers[k] == builtin) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Escape analysis of the expression v, whose value escapes if it can outlive
+ * the expression using it */
+static void
+lcode_escape(struct lcompiler* c, struct lval* v, bool escapes) {
+    if (lval_type(v) == LVAL_SEXPR) {
+        lcode_escape_list(c, v, v->cell, v->count, escapes);
+    }
+}
+
+/* Escape analysis of the S-expression v given by its cells, following the
+ * compilation of lcode_list : the value of the body escapes, like the
+ * arguments of lambdas and the ones builtins keep, while the tests of cond
+ * and select, the values dropped by do and the arguments only read by
+ * builtins are temporaries. The calls of builtins allocating their result are
+ * recorded as sites */
+static void
+lcode_escape_list(struct lcompiler* c, struct lval* v, struct lval** cells,
+                  int count, bool escapes) {
+    if (count == 1) {
+        lcode_escape(c, cells[0], escapes);
+        return;
+    }
+    struct lval* builtin = (count > 1 && lval_type(cells[0]) == LVAL_SYM)
+                               ? lcode_find_builtin(c, cells[0])
+                               : NULL;
+    if (!builtin) {
+        for (int i = 0; i < count; ++i) {
+            lcode_escape(c, cells[i], true);
+        }
+        return;
+    }
+
+    lbuiltin b = builtin->builtin;
+    if (lcode_allocates(b)) {
+        if (c->site_count == c->sites_size) {
+            c->sites_size = c->sites_size ? 2 * c->sites_size : 8;
+            c->sites =
+                realloc(c->sites, c->sites_size * sizeof(struct lcode_site));
+            assert(c->sites);
+        }
+        c->sites[c->site_count++] = (struct lcode_site){v, escapes, false};
+    }
+    if (b == builtin_cond && count == 4 && lval_type(cells[2]) == LVAL_QEXPR &&
+        lval_type(cells[3]) == LVAL_QEXPR) {
+        lcode_escape(c, cells[1], false);
+        for (int i = 2; i < 4; ++i) {
+            lcode_escape_list(c, cells[i], cells[i]->cell, cells[i]->count,
+                              escapes);
+        }
+        return;
+    }
+    if (b == builtin_select && lcode_is_select(cells, count)) {
+        for (int i = 1; i < count; ++i) {
+            lcode_escape(c, cells[i]->cell[0], false);
+            lcode_escape(c, cells[i]->cell[1], escapes);
+        }
+        return;
+    }
+    if (b == builtin_do) {
+        for (int i = 1; i < count; ++i) {
+            lcode_escape(c, cells[i], escapes && i == count - 1);
+        }
+        return;
+    }
+    /* The result of tail and init is a slice of their argument, which lives
+     * as long as it */
+    bool slice = (b == builtin_tail || b == builtin_init);
+    for (int i = 1; i < count; ++i) {
+        lcode_escape(c, cells[i], slice ? escapes : lcode_keeps_arg(b, i));
+    }
+}
+
+/* Site of the call expr, or NULL if it does not allocate */
+static struct lcode_site*
+lcode_site(struct lcompiler* c, struct lval* expr) {
+    for (int i = 0; i < c->site_count; ++i) {
+        if (c->sites[i].expr == expr) {
+            return &c->sites[i];
+        }
+    }
+    return NULL;
+}
+
+/* Print the sites of the body on stderr, for LISPY_ESCAPE_DUMP */
+static void
+lcode_print_sites(struct lcompiler* c, struct lval* body) {
+    if (c->site_count == 0) {
+        return;
+    }
+    fprintf(stderr, "Escape : ");
+    lval_fprint(stderr, c->formals);
+    fputc(' ', stderr);
+    lval_fprint(stderr, body);
+    fputc('\n', stderr);
+    for (int i = 0; i < c->site_count; ++i) {
+        struct lcode_site* site = &c->sites[i];
+        const char* status = site->escapes  ? "escapes"
+                             : site->elided ? "temporary, not allocated"
+                                            : "temporary";
+        fprintf(stderr, "Escape :     ");
+        lval_fprint(stderr, site->expr);
+        fprintf(stderr, " : %s\n", status);
+    }
+}
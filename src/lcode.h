@@ -0,0 +1,169 @@
+#ifndef LCODE_H_
+#define LCODE_H_
+
+/** Bytecode of the lambda bodies, run by the VM of lvm.h
+ *
+ * A lambda is compiled once, when lval_lambda creates it. Its body becomes a
+ * flat array of ints : an opcode followed by its operands. Every expression
+ * pushes its value on the stack of the VM, and a call replaces the function
+ * and its arguments by the result.
+ *
+ * The compiler relies on two properties of the language :
+ * - Builtin names are never rebound (def, = and the formals of lambdas
+ *   refuse them), so a builtin in head position is called directly, and
+ *   cond, select and do with literal branches are compiled inline. Their
+ *   last expression is in tail position, so loops written with them run in
+ *   a constant stack. eval, and cond with other branches, are run by the
+ *   VM as well : the Q-expression is compiled when it is first evaluated,
+ *   and keeps its code for the next times.
+ * - The formals of a lambda are always bound in the environment of its
+ *   frame, and the symbols captured by its closure, from the frame creating
+ *   it, are known when it is created (see lenv.h). Both are resolved when
+ *   the lambda is compiled, and read by position from the slots of the
+ *   frame or from the closure. The other symbols are looked up in the
+ *   frame, then in the global environment.
+ *
+ * An escape analysis of the body, run before it is compiled, finds the lists
+ * allocated by builtins (head, tail, list...) that cannot outlive the
+ * expression using them, because it only reads them : these temporaries are
+ * not allocated when the code can read what they would hold in place, like
+ * in (eval (head l)). Setting the LISPY_ESCAPE_DUMP environment variable
+ * prints the results of the analysis of every body on stderr.
+ *
+ * Calls of pure builtins (arithmetic, comparisons, logic, len, head and tail)
+ * whose arguments are constants are folded : their value is computed by the
+ * compiler. Literals are constants, and so are the names bound once in the
+ * global environment to a value other than a function (see LSYM_REDEFINED).
+ * Only the values that are immediates are folded. An expression without
+ * names becomes a constant, the other ones keep their code, run instead once
+ * one of their names may have changed (see LOP_FOLDED).
+ *
+ * Constants are not owned by the code : they are immediates, shared
+ * constants (nil, the empty S-expression, the builtins of the global
+ * environment) or nodes of the body, which the lambda keeps alive.
+ */
+
+#include "lval.h"
+
+enum {
+    /* k : push consts[k] */
+    LOP_CONST,
+    /* k : push the formal at position k, from the slots of the frame */
+    LOP_LOCAL,
+    /* k : push the value at position k of the closure of the lambda, unless
+     * its name is bound in the frame */
+    LOP_CAPTURED,
+    /* k c : push the value of the symbol consts[k], found through the inline
+     * cache caches[c] */
+    LOP_GLOBAL,
+    /* n : call the function below the n arguments on top of the stack */
+    LOP_CALL,
+    /* n : same as LOP_CALL, and return its result */
+    LOP_TAIL_CALL,
+    /* k n : call builtins[k] with the n arguments on top of the stack */
+    LOP_BUILTIN,
+    /* n : pop the argument of eval (n = 1), or the three arguments of cond
+     * (n = 3), and evaluate the Q-expression they give in a new frame, which
+     * shares the environment of the current one. Its code is compiled once,
+     * see lcode_compile_eval */
+    LOP_EVAL,
+    /* n : same as LOP_EVAL, and return its result */
+    LOP_TAIL_EVAL,
+    /* k : pop a Q-expression x and evaluate (head x) after k calls of tail,
+     * without making these lists if its element k is not a S-expression */
+    LOP_EVAL_HEAD,
+    /* k : same as LOP_EVAL_HEAD, and return its result */
+    LOP_TAIL_EVAL_HEAD,
+    /* k t n c... : push consts[k], folded from the global constants named by
+     * the n symbols consts[c...], and continue at t if none of them may have
+     * changed since the code was compiled (see LSYM_REDEFINED). Else continue
+     * with the code computing the value */
+    LOP_FOLDED,
+    /* t : continue at t */
+    LOP_JUMP,
+    /* t end : pop a boolean and continue at t if it is false. Other values
+     * are replaced by the error of builtin_cond, and continue at end */
+    LOP_JUMP_IF_FALSE,
+    /* t : pop a value and delete it. An error is kept as the value of the
+     * expression instead, and continues at t */
+    LOP_DROP,
+    /* Builtins with two arguments : replace them by the result */
+    LOP_ADD,
+    LOP_SUB,
+    LOP_MUL,
+    LOP_DIV,
+    LOP_MOD,
+    LOP_EQ,
+    LOP_NE,
+    LOP_GT,
+    LOP_GE,
+    LOP_LT,
+    LOP_LE,
+    /* Pop the result of the frame and return it */
+    LOP_RETURN,
+
+    /* Superinstructions, for the most frequent sequences of opcodes (see the
+     * profiler of lvm.c). op is the opcode of a binary builtin */
+    /* op k j : push op applied to the formal at position k and consts[j] */
+    LOP_BINARY_LOCAL_CONST,
+    /* op t end : pop two values, apply op to them and branch on the result
+     * like LOP_JUMP_IF_FALSE */
+    LOP_BINARY_JUMP,
+    /* op k j t end : LOP_BINARY_LOCAL_CONST followed by LOP_JUMP_IF_FALSE */
+    LOP_BINARY_LOCAL_CONST_JUMP,
+
+    /* Number of opcodes */
+    LOP_COUNT
+};
+
+/* Inline cache of a LOP_GLOBAL : the value bound to the symbol in the global
+ * environment, valid while the version of the global bindings is unchanged
+ * (see lenv_version). NULL if the symbol needs a lookup */
+struct lcode_cache {
+    unsigned long version;
+    struct lval* value;
+};
+
+struct lcode {
+    /* Shared by the copies of a lambda */
+    int refcount;
+
+    int* ops;
+    int count;
+
+    struct lval** consts;
+    int const_count;
+
+    lbuiltin* builtins;
+    int builtin_count;
+
+    struct lcode_cache* caches;
+    int cache_count;
+
+    /* Stack slots needed by a frame */
+    int max_stack;
+};
+
+/* Read LISPY_ESCAPE_DUMP */
+void lcode_init(void);
+
+/* Compile the body of a lambda created in e, whose closure captures the
+ * symbols of closure_names, which may be NULL */
+struct lcode* lcode_compile(struct lenv* e, struct lval* formals,
+                            struct lval* closure_names, struct lval* body);
+
+/* Get a reference to the code of the Q-expression x evaluated by eval or cond
+ * in the frame e, see LOP_EVAL. It is compiled for the first evaluation, and
+ * kept by x for the next ones in any frame until x changes */
+struct lcode* lcode_compile_eval(struct lenv* e, struct lval* x);
+
+/* Name of an opcode, for the profiler of the VM */
+const char* lcode_op_name(int op);
+
+/* Take a new reference to the code, which may be NULL */
+struct lcode* lcode_ref(struct lcode* code);
+
+/* Drop a reference to the code, which may be NULL */
+void lcode_del(struct lcode* code);
+
+#endif /* LCODE_H_ */
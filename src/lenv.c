@@ -1,90 +1,420 @@
 #include "lenv.h"
+#include <assert.h>
+#include <stdlib.h>
 #include <string.h>
 #include "evaluation.h"
+#include "lalloc.h"
+#include "lgc.h"
+#include "lsym.h"
+
+/* Environment given to lenv_add_builtins */
+static _Thread_local struct lenv* lenv_global;
+
+_Thread_local unsigned long lenv_version = 1;
+
+/* Slots in a chunk of the stack of slots */
+#define LENV_CHUNK_SLOTS 4096
+
+/* Chunk of the stack where the slots of the frames are allocated. The chunks
+ * in use are linked by prev, and the last one keeps the next chunk, emptied,
+ * for when the stack grows again */
+struct lenv_chunk {
+    struct lenv_chunk* prev;
+    struct lenv_chunk* next;
+    struct lval** top;
+    struct lval** end;
+    struct lval* slots[];
+};
+
+/* Chunk holding the top of the stack of slots of the calling thread */
+static _Thread_local struct lenv_chunk* lenv_stack;
+
+static struct lenv* lenv_alloc(void);
+static struct lval** lenv_push_slots(int count);
+static void lenv_pop_slots(struct lval** slots);
+static int lenv_slot(struct lenv* e, struct lval* k);
+static struct lval* lenv_lookup_frame(struct lenv* e, struct lval* k);
+static struct lval* lenv_lookup(struct lenv* e, struct lval* k);
+static void lenv_del_slots(struct lenv* e);
+static void lenv_clear_late(struct lval* v, void* ctx);
+static void lenv_count_late(struct lval* v, void* ctx);
+static void lenv_del_table(struct lenv* e);
+
+static struct lenv*
+lenv_alloc(void) {
+#ifdef LISPY_GC
+    return lgc_alloc(LALLOC_LENV);
+#else
+    return lalloc(LALLOC_LENV);
+#endif
+}
+
+/* Allocate count empty slots on top of the stack of slots */
+static struct lval**
+lenv_push_slots(int count) {
+    struct lenv_chunk* c = lenv_stack;
+    if (!c || c->end - c->top < count) {
+        struct lenv_chunk* next = c ? c->next : NULL;
+        if (next && next->end - next->slots < count) {
+            free(next);
+            next = NULL;
+        }
+        if (!next) {
+            int size = count > LENV_CHUNK_SLOTS ? count : LENV_CHUNK_SLOTS;
+            next = malloc(sizeof(struct lenv_chunk) +
+                          size * sizeof(struct lval*));
+            assert(next);
+            next->prev = c;
+            next->next = NULL;
+            next->end = next->slots + size;
+            if (c) {
+                c->next = next;
+            }
+        }
+        next->top = next->slots;
+        lenv_stack = c = next;
+    }
+    struct lval** slots = c->top;
+    c->top += count;
+    memset(slots, 0, count * sizeof(struct lval*));
+    return slots;
+}
+
+/* Give back the slots on top of the stack, from slots to its top */
+static void
+lenv_pop_slots(struct lval** slots) {
+    struct lenv_chunk* c = lenv_stack;
+    /* Frames are deleted in the reverse order of their creation */
+    assert(slots >= c->slots && slots <= c->top);
+    c->top = slots;
+    if (c->top == c->slots && c->prev) {
+        /* c is kept for the next push, but not its own next chunk */
+        if (c->next) {
+            free(c->next);
+            c->next = NULL;
+        }
+        lenv_stack = c->prev;
+    }
+}
+
+void
+lenv_cleanup(void) {
+    struct lenv_chunk* c = lenv_stack;
+    if (!c) {
+        return;
+    }
+    if (c->next) {
+        free(c->next);
+    }
+    while (c) {
+        struct lenv_chunk* prev = c->prev;
+        free(c);
+        c = prev;
+    }
+    lenv_stack = NULL;
+}
 
 struct lenv*
 lenv_new(mpc_parser_t* Lispy) {
-    struct lenv* e = malloc(sizeof(struct lenv));
+    struct lenv* e = lenv_alloc();
     e->par = NULL;
-    e->count = 0;
-    e->syms = NULL;
-    e->vals = NULL;
+    e->table = ltable_new();
     e->Lispy = Lispy;
+    e->fun = NULL;
+    e->slots = NULL;
+    lgc_account(e);
     return e;
 }
 
 struct lenv*
-lenv_copy(struct lenv* rhs) {
-    struct lenv* e = malloc(sizeof(struct lenv));
-    e->par = rhs->par;
-    e->count = rhs->count;
-    e->syms = malloc(sizeof(char*) * e->count);
-    e->vals = malloc(sizeof(struct lval*) * e->count);
-    e->Lispy = rhs->Lispy;
-
-    for (int i = 0; i < e->count; ++i) {
-        e->syms[i] = strdup(rhs->syms[i]);
-        e->vals[i] = lval_copy(rhs->vals[i]);
-    }
+lenv_new_frame(mpc_parser_t* Lispy, struct lval* f) {
+    struct lenv* e = lenv_alloc();
+    e->par = NULL;
+    e->table = NULL;
+    e->Lispy = Lispy;
+    e->fun = lval_ref(f);
+    e->slots = lenv_push_slots(f->formals->count);
     return e;
 }
 
+void
+lenv_reset_frame(struct lenv* e, struct lval* f) {
+    if (e->table) {
+        lenv_del_table(e);
+        e->table = NULL;
+        lgc_account(e);
+    }
+    lval_ref(f);
+    if (e->fun->formals == f->formals) {
+        /* The slots have the right size */
+        for (int i = 0; i < f->formals->count; ++i) {
+            if (e->slots[i]) {
+                lval_del(e->slots[i]);
+                e->slots[i] = NULL;
+            }
+        }
+        lval_del(e->fun);
+        e->fun = f;
+        return;
+    }
+    lenv_del_slots(e);
+    e->fun = f;
+    e->slots = lenv_push_slots(f->formals->count);
+}
+
+/* Empty a binding made before its name was bound in the frame. The lambdas
+ * refering to their own name hold such a binding, which would otherwise keep
+ * them alive, and the lambdas still holding it after the call look the name
+ * up in the global environment */
+static void
+lenv_clear_late(struct lval* v, void* ctx) {
+    (void)ctx;
+    if (!lval_is_imm(v) && v->type == LVAL_BOX && v->late && v->boxed) {
+        struct lval* boxed = v->boxed;
+        v->boxed = NULL;
+        lval_del(boxed);
+    }
+}
+
+/* Delete the table of the frame e, once its call is done */
+static void
+lenv_del_table(struct lenv* e) {
+    ltable_foreach(e->table, lenv_clear_late, NULL);
+    ltable_del(e->table);
+}
+
+/* Delete the values of the slots of e and its lambda, and give the slots
+ * back to the stack */
+static void
+lenv_del_slots(struct lenv* e) {
+    if (!e->fun) {
+        return;
+    }
+    for (int i = 0; i < e->fun->formals->count; ++i) {
+        if (e->slots[i]) {
+            lval_del(e->slots[i]);
+        }
+    }
+    lenv_pop_slots(e->slots);
+    lval_del(e->fun);
+    e->fun = NULL;
+    e->slots = NULL;
+}
+
 void
 lenv_del(struct lenv* e) {
-    for (int i = 0; i < e->count; ++i) {
-        free(e->syms[i]);
-        lval_del(e->vals[i]);
+    if (e == lenv_global) {
+        lenv_global = NULL;
+        lenv_version++;
+    }
+    lenv_del_slots(e);
+    if (e->table) {
+        if (e->par) {
+            lenv_del_table(e);
+        } else {
+            ltable_del(e->table);
+        }
     }
-    free(e->syms);
-    free(e->vals);
-    free(e);
+#ifdef LISPY_GC
+    lgc_free(e);
+#else
+    lfree(e);
+#endif
 }
 
-struct lval*
-lenv_get(struct lenv* e, struct lval* k) {
-    for (int i = 0; i < e->count; ++i) {
-        if (strcmp(e->syms[i], k->sym) == 0) {
-            return lval_copy(e->vals[i]);
+/* Position of the formal k in the frame e, or -1. The last one wins when a
+ * name is repeated, like it would by binding the formals in order */
+static inline int
+lenv_slot(struct lenv* e, struct lval* k) {
+    struct lval* formals = e->fun->formals;
+    for (int i = formals->count - 1; i >= 0; --i) {
+        if (formals->cell[i] == k) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* Find the value bound to k in e itself : in its slots and table, then in the
+ * closure of the lambda of a frame. The bindings shared with closures are
+ * skipped while they hold no value */
+static struct lval*
+lenv_lookup_frame(struct lenv* e, struct lval* k) {
+    if (e->fun) {
+        int i = lenv_slot(e, k);
+        if (i >= 0 && e->slots[i]) {
+            return lval_unbox(e->slots[i]);
+        }
+    }
+    struct lval* v = e->table ? ltable_get(e->table, lval_to_sym(k)) : NULL;
+    if (v && (v = lval_unbox(v))) {
+        return v;
+    }
+    if (!e->fun || !e->fun->closure) {
+        return NULL;
+    }
+    struct lval* names = e->fun->closure_names;
+    for (int i = 0; i < names->count; ++i) {
+        if (names->cell[i] == k) {
+            return e->fun->closure->cell[i]->boxed;
+        }
+    }
+    return NULL;
+}
+
+/* Find the value bound to k from e, without copying it. Scoping is lexical :
+ * the names bound in e are looked up there, the other ones in the global
+ * environment only, whatever the depth of the calls. The names that were
+ * never bound outside of the global environment, like builtins and global
+ * functions, are looked up there directly */
+static struct lval*
+lenv_lookup(struct lenv* e, struct lval* k) {
+    if (!e->par) {
+        return ltable_get(e->table, lval_to_sym(k));
+    }
+    if (*lsym_flags(lval_to_sym(k)) & LSYM_LOCAL) {
+        struct lval* v = lenv_lookup_frame(e, k);
+        if (v) {
+            return v;
+        }
+    }
+    struct lenv* root = lenv_global;
+    if (!root) {
+        for (root = e; root->par; root = root->par) {
         }
     }
+    return ltable_get(root->table, lval_to_sym(k));
+}
 
-    if (e->par) {
-        return lenv_get(e->par, k);
+struct lval*
+lenv_get(struct lenv* e, struct lval* k) {
+    struct lval* v = lenv_lookup(e, k);
+    if (v) {
+        return lval_ref(v);
     }
-    return lval_err("Unbound symbol '%s' !", k->sym);
+    return lval_err("Unbound symbol '%s' !", lval_to_sym(k));
 }
 
 bool
 lenv_is_builtin(struct lenv* e, struct lval* k) {
-    struct lval* target = lenv_get(e, k);
     /* Special symbols : exit, t , f */
-    if (strcmp(k->sym, "exit") == 0 || strcmp(k->sym, "t") == 0 ||
-        strcmp(k->sym, "f") == 0 || strcmp(k->sym, "nil") == 0) {
+    char* sym = lval_to_sym(k);
+    if (sym == lsym_exit || sym == lsym_t || sym == lsym_f || sym == lsym_nil) {
         return true;
     }
-    if (target->type != LVAL_FUN) {
+
+    struct lval* target = lenv_lookup(e, k);
+    if (!target || lval_type(target) != LVAL_FUN) {
         return false;
     }
 
     return (target->builtin != NULL);
 }
 
-void
-lenv_put(struct lenv* e, struct lval* k, struct lval* v) {
-    for (int i = 0; i < e->count; ++i) {
-        if (strcmp(e->syms[i], k->sym) == 0) {
-            lval_del(e->vals[i]);
-            e->vals[i] = lval_copy(v);
-            return;
+/* Binding of k in the frame e itself, made shared with the closures if it is
+ * not yet : the address of its slot, table entry or closure cell, or NULL */
+static struct lval*
+lenv_share(struct lenv* e, struct lval* k) {
+    int i = lenv_slot(e, k);
+    if (i >= 0 && e->slots[i]) {
+        if (lval_is_imm(e->slots[i]) || e->slots[i]->type != LVAL_BOX) {
+            e->slots[i] = lval_box(e->slots[i]);
+        }
+        return e->slots[i];
+    }
+    struct lval* v = e->table ? ltable_get(e->table, lval_to_sym(k)) : NULL;
+    if (v) {
+        if (lval_is_imm(v) || v->type != LVAL_BOX) {
+            /* ltable_put deletes the reference the table held */
+            v = lval_box(lval_ref(v));
+            ltable_put(e->table, lval_to_sym(k), v);
         }
+        return v;
     }
+    struct lval* names = e->fun->closure_names;
+    for (i = 0; names && i < names->count; ++i) {
+        if (names->cell[i] == k) {
+            return e->fun->closure->cell[i];
+        }
+    }
+    return NULL;
+}
 
-    e->count++;
-    e->vals = realloc(e->vals, sizeof(struct lval*) * e->count);
-    e->syms = realloc(e->syms, sizeof(char*) * e->count);
+struct lval*
+lenv_capture(struct lenv* e, struct lval* k) {
+    /* The closure of the lambda of e holds the bindings of the frames around
+     * it, so e is the only one searched */
+    struct lval* box = lenv_share(e, k);
+    if (box) {
+        return lval_ref(box);
+    }
+    char* sym = lval_to_sym(k);
+    if (lenv_global && ltable_get(lenv_global->table, sym)) {
+        return NULL;
+    }
+    /* Bound late, by a = in e while its call lasts. The name is only marked
+     * local by that = : until then it is looked up in the global environment,
+     * like the empty binding says */
+    box = lval_box(NULL);
+    box->late = true;
+    if (!e->table) {
+        e->table = ltable_new_sized(1);
+    }
+    ltable_put(e->table, sym, box);
+    lgc_account(e);
+    return lval_ref(box);
+}
+
+struct lval*
+lenv_global_value(struct lval* k) {
+    if (!lenv_global || (*lsym_flags(lval_to_sym(k)) & LSYM_LOCAL)) {
+        return NULL;
+    }
+    return ltable_get(lenv_global->table, lval_to_sym(k));
+}
 
-    e->vals[e->count - 1] = lval_copy(v);
-    e->syms[e->count - 1] = strdup(k->sym);
+void
+lenv_mark_local(struct lval* k) {
+    unsigned long* flags = lsym_flags(lval_to_sym(k));
+    if (!(*flags & LSYM_LOCAL)) {
+        *flags |= LSYM_LOCAL;
+        lenv_version++;
+    }
+}
+
+void
+lenv_put(struct lenv* e, struct lval* k, struct lval* v) {
+    if (e != lenv_global) {
+        lenv_mark_local(k);
+    } else {
+        /* The previous value may be cached */
+        lenv_version++;
+        if (ltable_get(e->table, lval_to_sym(k))) {
+            *lsym_flags(lval_to_sym(k)) |= LSYM_REDEFINED;
+        }
+    }
+    int i = e->fun ? lenv_slot(e, k) : -1;
+    struct lval* old = i >= 0 ? e->slots[i]
+                     : e->table ? ltable_get(e->table, lval_to_sym(k))
+                                : NULL;
+    if (old && !lval_is_imm(old) && old->type == LVAL_BOX) {
+        /* Shared with closures, which see the new value */
+        struct lval* boxed = old->boxed;
+        old->boxed = lval_ref(v);
+        if (boxed) {
+            lval_del(boxed);
+        }
+        return;
+    }
+    if (i >= 0) {
+        lenv_set_slot(e, i, lval_ref(v));
+        return;
+    }
+    if (!e->table) {
+        e->table = ltable_new_sized(1);
+    }
+    ltable_put(e->table, lval_to_sym(k), lval_ref(v));
+    lgc_account(e);
 }
 
 void
@@ -96,6 +426,54 @@ lenv_def(struct lenv* e, struct lval* k, struct lval* v) {
     lenv_put(e, k, v);
 }
 
+/* Count in ctx the bindings made by lenv_capture for a later = which were
+ * given a value since */
+static void
+lenv_count_late(struct lval* v, void* ctx) {
+    if (!lval_is_imm(v) && v->type == LVAL_BOX && v->late && v->boxed) {
+        ++*(int*)ctx;
+    }
+}
+
+bool
+lenv_reusable(struct lenv* e) {
+    if (!e->fun) {
+        return false;
+    }
+    int late = 0;
+    if (e->table) {
+        ltable_foreach(e->table, lenv_count_late, &late);
+    }
+    return late == 0;
+}
+
+void
+lenv_foreach(struct lenv* e, void (*visit)(struct lval*, void*), void* ctx) {
+    if (e->table) {
+        ltable_foreach(e->table, visit, ctx);
+    }
+    if (e->fun) {
+        for (int i = 0; i < e->fun->formals->count; ++i) {
+            if (e->slots[i]) {
+                visit(e->slots[i], ctx);
+            }
+        }
+        visit(e->fun, ctx);
+    }
+}
+
+unsigned long
+lenv_bytes(struct lenv* e) {
+    return e->table ? ltable_bytes(e->table) : 0;
+}
+
+void
+lenv_free(struct lenv* e) {
+    if (e->table) {
+        ltable_free(e->table);
+    }
+}
+
 void
 lenv_add_builtin(struct lenv* e, char* name, lbuiltin fun) {
     struct lval* key = lval_sym(name);
@@ -115,6 +493,8 @@ lenv_add_builtin_symbol(struct lenv* e, char* name, struct lval* value) {
 
 void
 lenv_add_builtins(struct lenv* e) {
+    lenv_global = e;
+    lenv_version++;
     lenv_add_builtin(e, "+", builtin_add);
     lenv_add_builtin(e, "-", builtin_sub);
     lenv_add_builtin(e, "*", builtin_mul);
@@ -144,12 +524,15 @@ lenv_add_builtins(struct lenv* e) {
     lenv_add_builtin(e, "init", builtin_init);
 
     lenv_add_builtin(e, "cond", builtin_cond);
+    lenv_add_builtin(e, "select", builtin_select);
+    lenv_add_builtin(e, "do", builtin_do);
 
     lenv_add_builtin(e, "def", builtin_def);
     lenv_add_builtin(e, "=", builtin_put);
 
     lenv_add_builtin(e, "\\", builtin_lambda);
     lenv_add_builtin(e, "fun", builtin_fun);
+    lenv_add_builtin(e, "let", builtin_let);
 
     lenv_add_builtin(e, "load", builtin_load);
     lenv_add_builtin(e, "print", builtin_print);
@@ -162,6 +545,6 @@ lenv_add_builtins(struct lenv* e) {
      */
     lenv_add_builtin_symbol(e, "t", lval_bool(true));
     lenv_add_builtin_symbol(e, "f", lval_bool(false));
-    lenv_add_builtin_symbol(e, "nil", lval_qexpr());
+    lenv_add_builtin_symbol(e, "nil", lval_nil());
     lenv_add_builtin_symbol(e, "exit", lval_exit_req("'exit' symbol"));
 }
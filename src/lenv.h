@@ -2,44 +2,122 @@
 #define LENV_H_
 
 #include <stdbool.h>
+#include "ltable.h"
 #include "lval.h"
 #include "mpc.h"
 
-/** TODO : Reimplement as a hash table
- * This default implementation gets really bad as the dictionnary gets bigger
- * since every operation is O(count). Implementing a proper hash table will
- * raise performance, and allow to compare the 2 classic implementations of hash
- * tables.
+/** The bindings of an environment are stored in a hash table mapping the
+ * symbol names to their values. The implementation of the table (separate
+ * chaining or open addressing) is chosen at build time, see ltable.h
  *
- * - The first hash table (for all symbols) is mapping char* syms[x] -> struct
- * lval* vals[x]
+ * The environment of a call of a lambda, its frame, stores the values of the
+ * formals by position instead, in its slots : the compiled body reads them
+ * by index (see LOP_LOCAL), and only the other names bound in the frame go
+ * to a table, created for the first one.
+ *
+ * A symbol is looked up in the frame, then in the closure of its lambda, then
+ * in the global environment, the one given to lenv_add_builtins. Scoping is
+ * lexical : a lambda created in a frame captures the bindings of its free
+ * symbols from that frame, and the closure of its lambda already holds the
+ * ones of the frames around it (see lval_lambda). The parent of a frame is
+ * the environment of the caller, which is never searched. A captured binding
+ * becomes a LVAL_BOX shared by the frame and the closure, so that both see
+ * the values given later with =, and a name not bound yet gets an empty one
+ * in the frame creating the lambda (see lenv_capture). These are emptied when
+ * the call is done, which breaks the cycle made by a lambda bound to a name
+ * it refers to.
+ *
+ * Since closures hold the bindings they capture and not the frame, nothing
+ * refers to a frame once its call is done : frames are deleted in the reverse
+ * order of their creation. Their slots are allocated on a stack, thread local
+ * like the pools of lalloc.h, sized to the formals of the lambda, and given
+ * back by moving the top of the stack down when the frame is deleted.
  */
 struct lenv {
     struct lenv* par;
-    int count;
-    char** syms;
-    struct lval** vals;
+    /* NULL in a frame until a name that is not a formal is bound */
+    struct ltable* table;
     mpc_parser_t* Lispy;
+
+    /* Frames only, NULL otherwise : the lambda called, which gives the
+     * formals and the closure, and the values of the formals by position.
+     * The slot of '&' stays NULL */
+    struct lval* fun;
+    struct lval** slots;
 };
 
+/* Version of the global bindings of the calling thread. It changes when a
+ * name is bound in the global environment, or may be bound in another one
+ * for the first time : a value found by lenv_global_value stays valid until
+ * then */
+extern _Thread_local unsigned long lenv_version;
+
 /* Create an environment */
 struct lenv* lenv_new(mpc_parser_t* Lispy);
 
-/* Create a copy of an environment */
-struct lenv* lenv_copy(struct lenv* rhs);
+/* Create the frame of a call of the lambda f, with empty slots */
+struct lenv* lenv_new_frame(mpc_parser_t* Lispy, struct lval* f);
 
-/* Delete an environment */
+/* Make the frame e the one of a new call of the lambda f, emptying it. e must
+ * be the last frame created */
+void lenv_reset_frame(struct lenv* e, struct lval* f);
+
+/* Bind the formal at position i of the frame e to v, taking the reference */
+static inline void
+lenv_set_slot(struct lenv* e, int i, struct lval* v) {
+    if (e->slots[i]) {
+        lval_del(e->slots[i]);
+    }
+    e->slots[i] = v;
+}
+
+/* Delete an environment. A frame must be the last one created that is not
+ * deleted yet */
 void lenv_del(struct lenv* e);
 
-/* Get a value in environment, return lval_err if not found */
+/* Get a reference to a value in environment, return lval_err if not found */
 struct lval* lenv_get(struct lenv* e, struct lval* k);
 
-/* Put a value in local environment */
+/* Get a reference to the binding of k in the frame e or the closure of its
+ * lambda, shared from now on with the closure capturing it. A name bound
+ * nowhere gets an empty binding in e, for a later =. Return NULL if it is
+ * bound in the global environment only */
+struct lval* lenv_capture(struct lenv* e, struct lval* k);
+
+/* Get the value of k if it can only be bound in the global environment, without
+ * taking a reference. Return NULL if it is unbound there, or if it may be bound
+ * in other environments and needs a lenv_get */
+struct lval* lenv_global_value(struct lval* k);
+
+/* Note that k may be bound in environments other than the global one, like
+ * the formals of a lambda */
+void lenv_mark_local(struct lval* k);
+
+/* Put a reference to a value in local environment */
 void lenv_put(struct lenv* e, struct lval* k, struct lval* v);
 
 /* Put value in global environment */
 void lenv_def(struct lenv* e, struct lval* k, struct lval* v);
 
+/* True if the frame e can be reused by another call once its own is done :
+ * the lambdas it created hold the bindings they captured, except the ones
+ * bound late, which are emptied with the frame (see lenv_capture) */
+bool lenv_reusable(struct lenv* e);
+
+/* Call visit on every value bound in e, and on the lambda of a frame */
+void lenv_foreach(struct lenv* e, void (*visit)(struct lval*, void*),
+                  void* ctx);
+
+/* Memory used by the table of e, not counting the values. The slots of a
+ * frame are on the stack of slots */
+unsigned long lenv_bytes(struct lenv* e);
+
+/* Free the table of e without deleting the values it holds */
+void lenv_free(struct lenv* e);
+
+/* Free the stack of slots of the calling thread */
+void lenv_cleanup(void);
+
 /* Initialization with builtins */
 void lenv_add_builtin(struct lenv* e, char* name, lbuiltin fun);
 
@@ -0,0 +1,419 @@
+#include "lgc.h"
+
+#ifdef LISPY_GC
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "lalloc.h"
+#include "lcode.h"
+#include "lenv.h"
+#include "lval.h"
+
+#define LGC_DEFAULT_GROWTH 2.0
+#define LGC_DEFAULT_MIN_HEAP (1UL << 20)
+
+/* Every managed object is preceded by this header, in the same slot */
+struct lgc_header {
+    /* The slot and the memory owned by the object. This is the first word of
+     * the slot, which lalloc reuses for its free list */
+    size_t size;
+
+    /* References to the object that do not come from the heap */
+    int gc_refs;
+    unsigned char kind;
+    bool marked;
+
+    /* False for the slots that were freed */
+    bool used;
+};
+
+#define LGC_OBJECT(h) ((void*)((h) + 1))
+#define LGC_HEADER(o) ((struct lgc_header*)(o)-1)
+
+/* Callback used to walk the children of an object */
+typedef void (*lgc_visitor)(struct lgc_header* child, void* ctx);
+
+static struct {
+    size_t heap_bytes;
+    size_t threshold;
+
+    double growth;
+    size_t min_heap;
+    bool print_stats;
+
+    /* Explicit stack used to mark the heap without recursion, then to hold
+     * the garbage until the sweep of the pools is done */
+    struct lgc_header** stack;
+    int stack_count;
+    int stack_size;
+
+    /* Statistics */
+    unsigned long collections;
+    unsigned long objects_freed;
+    unsigned long bytes_reclaimed;
+    double total_pause;
+    double max_pause;
+} lgc;
+
+static size_t lgc_slot_bytes(int kind);
+static void lgc_foreach(void (*visit)(void* slot, void* ctx));
+static void lgc_children(struct lgc_header* h, lgc_visitor visit, void* ctx);
+static void lgc_visit_value(struct lval* v, void* ctx);
+static void lgc_stack_push(struct lgc_header* h);
+static void lgc_prepare(void* slot, void* ctx);
+static void lgc_subtract(void* slot, void* ctx);
+static void lgc_unref(struct lgc_header* child, void* ctx);
+static void lgc_root(void* slot, void* ctx);
+static void lgc_push(struct lgc_header* child, void* ctx);
+static void lgc_sweep(void* slot, void* ctx);
+static void lgc_release_ref(struct lgc_header* child, void* ctx);
+static size_t lgc_payload_bytes(struct lgc_header* h);
+static void lgc_free_payload(struct lgc_header* h);
+static void lgc_cleanup_slot(void* slot, void* ctx);
+static double lgc_now(void);
+
+void
+lgc_init(void) {
+    memset(&lgc, 0, sizeof(lgc));
+
+    char* growth = getenv("LISPY_GC_GROWTH");
+    lgc.growth = growth ? strtod(growth, NULL) : LGC_DEFAULT_GROWTH;
+    if (lgc.growth < 1.0) {
+        lgc.growth = LGC_DEFAULT_GROWTH;
+    }
+
+    char* min_heap = getenv("LISPY_GC_MIN_HEAP");
+    lgc.min_heap = min_heap ? strtoul(min_heap, NULL, 10) : LGC_DEFAULT_MIN_HEAP;
+
+    lgc.print_stats = (getenv("LISPY_GC_STATS") != NULL);
+    lgc.threshold = lgc.min_heap;
+
+    lalloc_init(sizeof(struct lgc_header));
+}
+
+static size_t
+lgc_slot_bytes(int kind) {
+    return sizeof(struct lgc_header) +
+           (kind == LALLOC_LVAL ? sizeof(struct lval) : sizeof(struct lenv));
+}
+
+void*
+lgc_alloc(int kind) {
+    if (lgc.heap_bytes >= lgc.threshold) {
+        lgc_collect();
+    }
+
+    struct lgc_header* h = lalloc(kind);
+    h->size = lgc_slot_bytes(kind);
+    h->kind = kind;
+    h->marked = false;
+    h->used = true;
+    lgc.heap_bytes += h->size;
+    return LGC_OBJECT(h);
+}
+
+void
+lgc_free(void* obj) {
+    struct lgc_header* h = LGC_HEADER(obj);
+    lgc.heap_bytes -= h->size;
+    h->used = false;
+    lfree(h);
+}
+
+void
+lgc_account(void* obj) {
+    struct lgc_header* h = LGC_HEADER(obj);
+    size_t size = lgc_slot_bytes(h->kind) + lgc_payload_bytes(h);
+    lgc.heap_bytes += size - h->size;
+    h->size = size;
+}
+
+/* Call visit on every slot of the pools */
+static void
+lgc_foreach(void (*visit)(void* slot, void* ctx)) {
+    lalloc_foreach(LALLOC_LVAL, visit, NULL);
+    lalloc_foreach(LALLOC_LENV, visit, NULL);
+}
+
+struct lgc_value_visit {
+    lgc_visitor visit;
+    void* ctx;
+};
+
+static void
+lgc_visit_value(struct lval* v, void* ctx) {
+    if (lval_is_imm(v)) {
+        return;
+    }
+    struct lgc_value_visit* value_visit = ctx;
+    value_visit->visit(LGC_HEADER(v), value_visit->ctx);
+}
+
+/* Call visit on every object directly referenced by h, immediates are skipped.
+ * Slots can be NULL while a value is being built or evaluated */
+static void
+lgc_children(struct lgc_header* h, lgc_visitor visit, void* ctx) {
+    if (h->kind == LALLOC_LENV) {
+        struct lgc_value_visit value_visit = {visit, ctx};
+        lenv_foreach(LGC_OBJECT(h), lgc_visit_value, &value_visit);
+        return;
+    }
+
+    struct lval* v = LGC_OBJECT(h);
+    switch (v->type) {
+        case LVAL_SEXPR:
+        case LVAL_QEXPR:
+            if (v->base) {
+                visit(LGC_HEADER(v->base), ctx);
+                break;
+            }
+            for (int i = 0; i < v->count; ++i) {
+                if (v->cell[i] && !lval_is_imm(v->cell[i])) {
+                    visit(LGC_HEADER(v->cell[i]), ctx);
+                }
+            }
+            break;
+        case LVAL_FUN:
+            if (v->builtin) {
+                break;
+            }
+            if (v->bound) {
+                visit(LGC_HEADER(v->bound), ctx);
+            }
+            if (v->formals) {
+                visit(LGC_HEADER(v->formals), ctx);
+            }
+            if (v->body) {
+                visit(LGC_HEADER(v->body), ctx);
+            }
+            if (v->closure) {
+                visit(LGC_HEADER(v->closure_names), ctx);
+                visit(LGC_HEADER(v->closure), ctx);
+            }
+            break;
+        case LVAL_BOX:
+            if (v->boxed && !lval_is_imm(v->boxed)) {
+                visit(LGC_HEADER(v->boxed), ctx);
+            }
+            break;
+    }
+}
+
+static void
+lgc_stack_push(struct lgc_header* h) {
+    if (lgc.stack_count == lgc.stack_size) {
+        lgc.stack_size = lgc.stack_size ? 2 * lgc.stack_size : 256;
+        lgc.stack =
+            realloc(lgc.stack, sizeof(struct lgc_header*) * lgc.stack_size);
+        assert(lgc.stack);
+    }
+    lgc.stack[lgc.stack_count++] = h;
+}
+
+static void
+lgc_prepare(void* slot, void* ctx) {
+    (void)ctx;
+    struct lgc_header* h = slot;
+    if (!h->used) {
+        return;
+    }
+    h->marked = false;
+    h->gc_refs = (h->kind == LALLOC_LVAL)
+                     ? ((struct lval*)LGC_OBJECT(h))->refcount
+                     : 0;
+}
+
+static void
+lgc_subtract(void* slot, void* ctx) {
+    (void)ctx;
+    struct lgc_header* h = slot;
+    if (h->used) {
+        lgc_children(h, lgc_unref, NULL);
+    }
+}
+
+static void
+lgc_unref(struct lgc_header* child, void* ctx) {
+    (void)ctx;
+    child->gc_refs--;
+}
+
+/* Nothing in the heap references an environment, they are all roots */
+static void
+lgc_root(void* slot, void* ctx) {
+    (void)ctx;
+    struct lgc_header* h = slot;
+    if (h->used && (h->kind == LALLOC_LENV || h->gc_refs > 0)) {
+        lgc_push(h, NULL);
+    }
+}
+
+static void
+lgc_push(struct lgc_header* child, void* ctx) {
+    (void)ctx;
+    if (child->marked) {
+        return;
+    }
+    child->marked = true;
+    lgc_stack_push(child);
+}
+
+/* Survivors lose the references held by the garbage, which is kept on the
+ * stack : freeing it now could give a block of the pools back to the OS */
+static void
+lgc_sweep(void* slot, void* ctx) {
+    (void)ctx;
+    struct lgc_header* h = slot;
+    if (h->used && !h->marked) {
+        lgc_children(h, lgc_release_ref, NULL);
+        lgc_stack_push(h);
+    }
+}
+
+static void
+lgc_release_ref(struct lgc_header* child, void* ctx) {
+    (void)ctx;
+    if (child->marked && child->kind == LALLOC_LVAL) {
+        ((struct lval*)LGC_OBJECT(child))->refcount--;
+    }
+}
+
+void
+lgc_collect(void) {
+    double start = lgc_now();
+
+    /* Subtract the references coming from the heap : what is left comes from
+     * the C stack */
+    lgc_foreach(lgc_prepare);
+    lgc_foreach(lgc_subtract);
+
+    /* Mark everything reachable from the roots */
+    lgc_foreach(lgc_root);
+    while (lgc.stack_count > 0) {
+        lgc_children(lgc.stack[--lgc.stack_count], lgc_push, NULL);
+    }
+
+    lgc_foreach(lgc_sweep);
+    while (lgc.stack_count > 0) {
+        struct lgc_header* h = lgc.stack[--lgc.stack_count];
+        lgc.objects_freed++;
+        lgc.bytes_reclaimed += h->size;
+        lgc_free_payload(h);
+        lgc_free(LGC_OBJECT(h));
+    }
+
+    lgc.threshold = lgc.heap_bytes * lgc.growth;
+    if (lgc.threshold < lgc.min_heap) {
+        lgc.threshold = lgc.min_heap;
+    }
+
+    double pause = lgc_now() - start;
+    lgc.collections++;
+    lgc.total_pause += pause;
+    if (pause > lgc.max_pause) {
+        lgc.max_pause = pause;
+    }
+}
+
+static size_t
+lgc_payload_bytes(struct lgc_header* h) {
+    if (h->kind == LALLOC_LENV) {
+        return lenv_bytes(LGC_OBJECT(h));
+    }
+
+    struct lval* v = LGC_OBJECT(h);
+    switch (v->type) {
+        case LVAL_BIG:
+            return lbig_bytes(v->big);
+        case LVAL_ERR:
+        case LVAL_EXIT_REQ:
+            return strlen(v->err) + 1;
+        case LVAL_STR:
+            return strlen(v->str) + 1;
+        case LVAL_SEXPR:
+        case LVAL_QEXPR:
+            return v->capacity * sizeof(struct lval*);
+        default:
+            return 0;
+    }
+}
+
+/* Free what an object owns, but not the objects it references */
+static void
+lgc_free_payload(struct lgc_header* h) {
+    if (h->kind == LALLOC_LENV) {
+        lenv_free(LGC_OBJECT(h));
+        return;
+    }
+
+    struct lval* v = LGC_OBJECT(h);
+    switch (v->type) {
+        case LVAL_BIG:
+            lbig_del(v->big);
+            break;
+        case LVAL_ERR:
+        case LVAL_EXIT_REQ:
+            free(v->err);
+            break;
+        case LVAL_STR:
+            free(v->str);
+            break;
+        case LVAL_SEXPR:
+        case LVAL_QEXPR:
+            lcode_del(v->eval_code);
+            free(v->block);
+            break;
+        case LVAL_FUN:
+            /* The code holds no reference, see lcode.h */
+            if (!v->builtin) {
+                lcode_del(v->code);
+            }
+            break;
+    }
+}
+
+static double
+lgc_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+void
+lgc_print_stats(void) {
+    fprintf(stderr,
+            "GC : %lu collections, pause %.3f ms total, %.3f ms max\n"
+            "GC : %lu objects freed, %lu bytes reclaimed\n"
+            "GC : heap %lu bytes, next collection at %lu bytes\n",
+            lgc.collections, lgc.total_pause * 1e3, lgc.max_pause * 1e3,
+            lgc.objects_freed, lgc.bytes_reclaimed,
+            (unsigned long)lgc.heap_bytes, (unsigned long)lgc.threshold);
+}
+
+static void
+lgc_cleanup_slot(void* slot, void* ctx) {
+    (void)ctx;
+    struct lgc_header* h = slot;
+    if (h->used) {
+        lgc_free_payload(h);
+    }
+}
+
+void
+lgc_cleanup(void) {
+    if (lgc.print_stats) {
+        lgc_print_stats();
+    }
+
+    lgc_foreach(lgc_cleanup_slot);
+    lalloc_cleanup();
+    free(lgc.stack);
+    memset(&lgc, 0, sizeof(lgc));
+}
+
+#endif /* LISPY_GC */
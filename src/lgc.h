@@ -0,0 +1,63 @@
+#ifndef LGC_H_
+#define LGC_H_
+
+/** Optional tracing garbage collector, built with `make GC=1`
+ *
+ * In this mode every lval and lenv is allocated from the pools of lalloc with
+ * a header in front of it. Values are still reference counted : lval_del and
+ * lenv_del free an object as soon as its last reference is dropped, with the
+ * references it holds. The collector only has to find the garbage that
+ * reference counting cannot free, the unreachable cycles, by marking the heap
+ * and sweeping the pools.
+ *
+ * The roots are the environments (the global environment and the frames of
+ * the calls) and the values referenced from the C evaluation stack. The latter
+ * are found without scanning the stack : a value whose reference count is
+ * higher than the number of references coming from the heap is held by C
+ * code, so it is a root.
+ *
+ * The heap size counts the objects and what they own (cells, strings, big
+ * integers, tables). A collection runs when it grows past a threshold, which
+ * is then set to the size of the live heap times a growth factor. It can be
+ * tuned with environment variables :
+ * - LISPY_GC_GROWTH : growth factor of the heap, 2.0 by default
+ * - LISPY_GC_MIN_HEAP : minimal threshold in bytes, 1 MiB by default
+ * - LISPY_GC_STATS : if set, print collection statistics on exit
+ */
+#ifdef LISPY_GC
+
+/* Read the tuning variables and start with an empty heap */
+void lgc_init(void);
+
+/* Allocate an object of the given kind, LALLOC_LVAL or LALLOC_LENV
+ * This may run a collection before allocating
+ */
+void* lgc_alloc(int kind);
+
+/* Free an object whose last reference was dropped. The caller already
+ * released what it owns and references */
+void lgc_free(void* obj);
+
+/* Count again the memory owned by an object, after it changed */
+void lgc_account(void* obj);
+
+/* Run a full collection */
+void lgc_collect(void);
+
+/* Print the statistics of the collector on stderr */
+void lgc_print_stats(void);
+
+/* Free the whole heap */
+void lgc_cleanup(void);
+
+#else
+
+/* Without the collector, nothing is accounted */
+static inline void
+lgc_account(void* obj) {
+    (void)obj;
+}
+
+#endif /* LISPY_GC */
+
+#endif /* LGC_H_ */
@@ -0,0 +1,126 @@
+#include "lsym.h"
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define LSYM_INITIAL_SIZE 256
+
+struct lsym_entry {
+    char* name; /* NULL for an empty slot */
+    unsigned long hash;
+};
+
+/* Open addressing table with linear probing, names are never removed */
+static struct {
+    int count;
+    int size;
+    struct lsym_entry* entries;
+} lsym_table;
+
+char* lsym_amp;
+char* lsym_exit;
+char* lsym_t;
+char* lsym_f;
+char* lsym_nil;
+
+static unsigned long lsym_hash(char* name);
+static struct lsym_entry* lsym_find(struct lsym_entry* entries, int size,
+                                    char* name, unsigned long hash);
+static void lsym_grow(void);
+
+void
+lsym_init(void) {
+    lsym_table.count = 0;
+    lsym_table.size = LSYM_INITIAL_SIZE;
+    lsym_table.entries = calloc(LSYM_INITIAL_SIZE, sizeof(struct lsym_entry));
+    assert(lsym_table.entries);
+
+    lsym_amp = lsym_intern("&");
+    lsym_exit = lsym_intern("exit");
+    lsym_t = lsym_intern("t");
+    lsym_f = lsym_intern("f");
+    lsym_nil = lsym_intern("nil");
+}
+
+/* FNV-1a */
+static unsigned long
+lsym_hash(char* name) {
+    unsigned long h = 14695981039346656037UL;
+    for (; *name; ++name) {
+        h ^= (unsigned char)*name;
+        h *= 1099511628211UL;
+    }
+    return h;
+}
+
+/* Return the slot holding name, or the empty slot where it should go */
+static struct lsym_entry*
+lsym_find(struct lsym_entry* entries, int size, char* name,
+          unsigned long hash) {
+    int mask = size - 1;
+    for (int i = hash & mask;; i = (i + 1) & mask) {
+        struct lsym_entry* slot = &entries[i];
+        if (!slot->name) {
+            return slot;
+        }
+        if (slot->hash == hash && strcmp(slot->name, name) == 0) {
+            return slot;
+        }
+    }
+}
+
+char*
+lsym_intern(char* name) {
+    unsigned long hash = lsym_hash(name);
+    struct lsym_entry* slot =
+        lsym_find(lsym_table.entries, lsym_table.size, name, hash);
+    if (slot->name) {
+        return slot->name;
+    }
+
+    /* The flags keep the name aligned on 8 bytes, for LVAL_TAG_SYM */
+    size_t len = strlen(name);
+    unsigned long* flags = malloc(sizeof(unsigned long) + len + 1);
+    assert(flags);
+    *flags = 0;
+    slot->name = memcpy(flags + 1, name, len + 1);
+    slot->hash = hash;
+    char* interned = slot->name;
+
+    lsym_table.count++;
+    if (4 * lsym_table.count > 3 * lsym_table.size) {
+        lsym_grow();
+    }
+    return interned;
+}
+
+static void
+lsym_grow(void) {
+    int new_size = lsym_table.size * 2;
+    struct lsym_entry* entries = calloc(new_size, sizeof(struct lsym_entry));
+    assert(entries);
+
+    for (int i = 0; i < lsym_table.size; ++i) {
+        struct lsym_entry* it = &lsym_table.entries[i];
+        if (it->name) {
+            *lsym_find(entries, new_size, it->name, it->hash) = *it;
+        }
+    }
+
+    free(lsym_table.entries);
+    lsym_table.entries = entries;
+    lsym_table.size = new_size;
+}
+
+void
+lsym_cleanup(void) {
+    for (int i = 0; i < lsym_table.size; ++i) {
+        if (lsym_table.entries[i].name) {
+            free(lsym_flags(lsym_table.entries[i].name));
+        }
+    }
+    free(lsym_table.entries);
+    lsym_table.entries = NULL;
+    lsym_table.count = 0;
+    lsym_table.size = 0;
+}
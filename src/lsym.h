@@ -0,0 +1,43 @@
+#ifndef LSYM_H_
+#define LSYM_H_
+
+/** Process-wide table of interned symbol names
+ *
+ * Every distinct symbol name is stored exactly once, so the char* sym of two
+ * LVAL_SYM are equal if and only if the pointers are equal. Interned names
+ * are never freed before lsym_cleanup, so they can be shared by any number of
+ * lval and lenv without copying.
+ *
+ * Every interned name is preceded by a word of flags, see lsym_flags.
+ */
+
+/* Names the interpreter has to recognize, set by lsym_init */
+extern char* lsym_amp;
+extern char* lsym_exit;
+extern char* lsym_t;
+extern char* lsym_f;
+extern char* lsym_nil;
+
+/* The name was bound in an environment other than the global one, or is a
+ * formal of a lambda */
+#define LSYM_LOCAL 0x1UL
+/* The name was bound again in the global environment, replacing its value :
+ * it is not a constant (see LOP_FOLDED) */
+#define LSYM_REDEFINED 0x2UL
+
+/* Flags of an interned name, that are never cleared */
+static inline unsigned long*
+lsym_flags(char* name) {
+    return (unsigned long*)name - 1;
+}
+
+/* Initialize the table and the well-known names */
+void lsym_init(void);
+
+/* Return the unique interned copy of name, adding it if needed */
+char* lsym_intern(char* name);
+
+/* Free all the interned names */
+void lsym_cleanup(void);
+
+#endif /* LSYM_H_ */
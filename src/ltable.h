@@ -0,0 +1,60 @@
+#ifndef LTABLE_H_
+#define LTABLE_H_
+
+/** Symbol table mapping interned char* keys -> struct lval* values, used by
+ * lenv
+ *
+ * Two classic hash table implementations are available, and one of them is
+ * picked at build time with the LENV_TABLE variable of the Makefile :
+ * - chain : separate chaining, every bucket is a linked list of entries
+ *   (src/ltable_chain.c)
+ * - open : open addressing with linear probing in a single array of entries
+ *   (src/ltable_open.c)
+ *
+ * Keys must come from lsym_intern, so they are hashed and compared by
+ * address. Tables never remove keys, since environments only ever add or
+ * replace bindings.
+ */
+
+struct lval;
+struct ltable;
+
+/* Create an empty table */
+struct ltable* ltable_new(void);
+
+/* Create an empty table holding count keys without growing */
+struct ltable* ltable_new_sized(int count);
+
+/* Delete a table and all the values it holds */
+void ltable_del(struct ltable* t);
+
+/* Get the value bound to key, or NULL if absent. The table keeps ownership */
+struct lval* ltable_get(struct ltable* t, char* key);
+
+/* Bind key to v, replacing (and deleting) any previous value.
+ * The table takes ownership of v
+ */
+void ltable_put(struct ltable* t, char* key, struct lval* v);
+
+/* Number of keys in the table */
+int ltable_count(struct ltable* t);
+
+/* Call visit on every value of the table */
+void ltable_foreach(struct ltable* t, void (*visit)(struct lval*, void*),
+                    void* ctx);
+
+/* Free a table without deleting the values it holds */
+void ltable_free(struct ltable* t);
+
+/* Memory used by the table itself, not counting the values */
+unsigned long ltable_bytes(struct ltable* t);
+
+/* Hash of an interned key, shared by both implementations
+ * Fibonacci hashing of the address, keeping the well mixed high bits
+ */
+static inline unsigned long
+ltable_hash(char* key) {
+    return ((unsigned long)key * 11400714819323198485UL) >> 32;
+}
+
+#endif /* LTABLE_H_ */
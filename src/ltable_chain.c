@@ -0,0 +1,160 @@
+/** Separate chaining implementation of struct ltable
+ *
+ * Every bucket holds a singly linked list of entries. The number of buckets is
+ * a power of 2 and doubles when the load factor goes above 1.
+ */
+#include "ltable.h"
+#include <assert.h>
+#include <stdlib.h>
+
+#include "lval.h"
+
+#define LTABLE_INITIAL_SIZE 8
+
+struct ltable_entry {
+    char* key;
+    struct lval* val;
+    struct ltable_entry* next;
+};
+
+struct ltable {
+    int count;
+    int size;
+    struct ltable_entry** buckets;
+};
+
+static struct ltable* ltable_alloc(int size);
+static void ltable_grow(struct ltable* t);
+static void ltable_del_value(struct lval* v, void* ctx);
+
+static struct ltable*
+ltable_alloc(int size) {
+    struct ltable* t = malloc(sizeof(struct ltable));
+    assert(t);
+    t->count = 0;
+    t->size = size;
+    t->buckets = calloc(size, sizeof(struct ltable_entry*));
+    assert(t->buckets);
+    return t;
+}
+
+struct ltable*
+ltable_new(void) {
+    return ltable_alloc(LTABLE_INITIAL_SIZE);
+}
+
+struct ltable*
+ltable_new_sized(int count) {
+    int size = 1;
+    while (size < count) {
+        size *= 2;
+    }
+    return ltable_alloc(size);
+}
+
+static void
+ltable_del_value(struct lval* v, void* ctx) {
+    (void)ctx;
+    lval_del(v);
+}
+
+void
+ltable_del(struct ltable* t) {
+    ltable_foreach(t, ltable_del_value, NULL);
+    ltable_free(t);
+}
+
+void
+ltable_free(struct ltable* t) {
+    for (int i = 0; i < t->size; ++i) {
+        struct ltable_entry* it = t->buckets[i];
+        while (it) {
+            struct ltable_entry* next = it->next;
+            free(it);
+            it = next;
+        }
+    }
+    free(t->buckets);
+    free(t);
+}
+
+struct lval*
+ltable_get(struct ltable* t, char* key) {
+    struct ltable_entry* it = t->buckets[ltable_hash(key) & (t->size - 1)];
+    for (; it; it = it->next) {
+        if (it->key == key) {
+            return it->val;
+        }
+    }
+    return NULL;
+}
+
+void
+ltable_put(struct ltable* t, char* key, struct lval* v) {
+    struct ltable_entry** bucket =
+        &t->buckets[ltable_hash(key) & (t->size - 1)];
+    for (struct ltable_entry* it = *bucket; it; it = it->next) {
+        if (it->key == key) {
+            lval_del(it->val);
+            it->val = v;
+            return;
+        }
+    }
+
+    struct ltable_entry* entry = malloc(sizeof(struct ltable_entry));
+    assert(entry);
+    entry->key = key;
+    entry->val = v;
+    entry->next = *bucket;
+    *bucket = entry;
+
+    t->count++;
+    if (t->count > t->size) {
+        ltable_grow(t);
+    }
+}
+
+int
+ltable_count(struct ltable* t) {
+    return t->count;
+}
+
+void
+ltable_foreach(struct ltable* t, void (*visit)(struct lval*, void*),
+               void* ctx) {
+    for (int i = 0; i < t->size; ++i) {
+        for (struct ltable_entry* it = t->buckets[i]; it; it = it->next) {
+            visit(it->val, ctx);
+        }
+    }
+}
+
+unsigned long
+ltable_bytes(struct ltable* t) {
+    return sizeof(struct ltable) + t->size * sizeof(struct ltable_entry*) +
+           t->count * sizeof(struct ltable_entry);
+}
+
+static void
+ltable_grow(struct ltable* t) {
+    int new_size = t->size * 2;
+    struct ltable_entry** buckets =
+        calloc(new_size, sizeof(struct ltable_entry*));
+    assert(buckets);
+
+    for (int i = 0; i < t->size; ++i) {
+        struct ltable_entry* it = t->buckets[i];
+        while (it) {
+            struct ltable_entry* next = it->next;
+            struct ltable_entry** bucket =
+                &buckets[ltable_hash(it->key) & (new_size - 1)];
+            it->next = *bucket;
+            *bucket = it;
+            it = next;
+        }
+    }
+
+    free(t->buckets);
+    t->buckets = buckets;
+    t->size = new_size;
+}
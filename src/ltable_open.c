@@ -0,0 +1,148 @@
+/** Open addressing implementation of struct ltable
+ *
+ * All entries live in one array, collisions are resolved with linear probing.
+ * The capacity is a power of 2 and doubles when the table gets more than 3/4
+ * full. Since keys are never removed, there is no need for tombstones.
+ */
+#include "ltable.h"
+#include <assert.h>
+#include <stdlib.h>
+
+#include "lval.h"
+
+#define LTABLE_INITIAL_SIZE 8
+
+struct ltable_entry {
+    char* key; /* NULL for an empty slot */
+    struct lval* val;
+};
+
+struct ltable {
+    int count;
+    int size;
+    struct ltable_entry* entries;
+};
+
+static struct ltable* ltable_alloc(int size);
+static struct ltable_entry* ltable_find(struct ltable_entry* entries, int size,
+                                        char* key);
+static void ltable_grow(struct ltable* t);
+static void ltable_del_value(struct lval* v, void* ctx);
+
+static struct ltable*
+ltable_alloc(int size) {
+    struct ltable* t = malloc(sizeof(struct ltable));
+    assert(t);
+    t->count = 0;
+    t->size = size;
+    t->entries = calloc(size, sizeof(struct ltable_entry));
+    assert(t->entries);
+    return t;
+}
+
+struct ltable*
+ltable_new(void) {
+    return ltable_alloc(LTABLE_INITIAL_SIZE);
+}
+
+struct ltable*
+ltable_new_sized(int count) {
+    /* At most 3/4 full, so that probing always finds an empty slot */
+    int size = 2;
+    while (4 * count > 3 * size) {
+        size *= 2;
+    }
+    return ltable_alloc(size);
+}
+
+static void
+ltable_del_value(struct lval* v, void* ctx) {
+    (void)ctx;
+    lval_del(v);
+}
+
+void
+ltable_del(struct ltable* t) {
+    ltable_foreach(t, ltable_del_value, NULL);
+    ltable_free(t);
+}
+
+void
+ltable_free(struct ltable* t) {
+    free(t->entries);
+    free(t);
+}
+
+/* Return the slot holding key, or the empty slot where it should be inserted */
+static struct ltable_entry*
+ltable_find(struct ltable_entry* entries, int size, char* key) {
+    int mask = size - 1;
+    for (int i = ltable_hash(key) & mask;; i = (i + 1) & mask) {
+        struct ltable_entry* slot = &entries[i];
+        if (!slot->key || slot->key == key) {
+            return slot;
+        }
+    }
+}
+
+struct lval*
+ltable_get(struct ltable* t, char* key) {
+    struct ltable_entry* slot = ltable_find(t->entries, t->size, key);
+    return slot->key ? slot->val : NULL;
+}
+
+void
+ltable_put(struct ltable* t, char* key, struct lval* v) {
+    struct ltable_entry* slot = ltable_find(t->entries, t->size, key);
+    if (slot->key) {
+        lval_del(slot->val);
+        slot->val = v;
+        return;
+    }
+
+    slot->key = key;
+    slot->val = v;
+
+    t->count++;
+    if (4 * t->count > 3 * t->size) {
+        ltable_grow(t);
+    }
+}
+
+int
+ltable_count(struct ltable* t) {
+    return t->count;
+}
+
+void
+ltable_foreach(struct ltable* t, void (*visit)(struct lval*, void*),
+               void* ctx) {
+    for (int i = 0; i < t->size; ++i) {
+        if (t->entries[i].key) {
+            visit(t->entries[i].val, ctx);
+        }
+    }
+}
+
+unsigned long
+ltable_bytes(struct ltable* t) {
+    return sizeof(struct ltable) + t->size * sizeof(struct ltable_entry);
+}
+
+static void
+ltable_grow(struct ltable* t) {
+    int new_size = t->size * 2;
+    struct ltable_entry* entries = calloc(new_size, sizeof(struct ltable_entry));
+    assert(entries);
+
+    for (int i = 0; i < t->size; ++i) {
+        struct ltable_entry* it = &t->entries[i];
+        if (it->key) {
+            *ltable_find(entries, new_size, it->key) = *it;
+        }
+    }
+
+    free(t->entries);
+    t->entries = entries;
+    t->size = new_size;
+}
@@ -1,19 +1,50 @@
 #include "lval.h"
 #include <assert.h>
+#include <inttypes.h>
+#include <math.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include "lalloc.h"
+#include "lcode.h"
 #include "lenv.h"
+#include "lgc.h"
+#include "lsym.h"
+#include "lvm.h"
 
 #define MAX_ERROR_LEN 512
 
-static struct lval* lval_eval_sexpr(struct lenv* e, struct lval* v);
-static void lval_print_str(struct lval* v);
+static void lval_print_str(FILE* out, struct lval* v);
+static void lval_cells_print(FILE* out, struct lval** cells, int count,
+                             char open, char close);
 static struct lval* lval_read_str(mpc_ast_t* t);
-/* Put all pointers to NULL */
-static void lval_default(struct lval* v);
+/* Allocate an lval of the given type, the caller sets the payload */
+static struct lval* lval_alloc(int type);
+static int lval_rest_index(struct lval* formals);
+static void lval_capture(struct lval* f, struct lenv* e, struct lval* x);
+static struct lval* lval_partial(struct lval* f, struct lval* a);
+
+/* Shared constants, see lval_init */
+static struct lval* lval_unit_value;
+static struct lval* lval_nil_value;
+
+void
+lval_init(void) {
+    lval_unit_value = lval_sexpr();
+    lval_unit_value->refcount = LVAL_IMMORTAL;
+    lval_nil_value = lval_qexpr();
+    lval_nil_value->refcount = LVAL_IMMORTAL;
+}
+
+void
+lval_cleanup(void) {
+    lval_unit_value->refcount = 1;
+    lval_del(lval_unit_value);
+    lval_nil_value->refcount = 1;
+    lval_del(lval_nil_value);
+}
 
 char*
 ltype_name(int t) {
@@ -22,6 +53,10 @@ ltype_name(int t) {
             return "Function";
         case LVAL_NUM:
             return "Number";
+        case LVAL_INT:
+            return "Integer";
+        case LVAL_BIG:
+            return "Big integer";
         case LVAL_ERR:
             return "Error";
         case LVAL_SYM:
@@ -36,40 +71,65 @@ ltype_name(int t) {
             return "Q-Expression";
         case LVAL_EXIT_REQ:
             return "Exit request";
+        case LVAL_BOX:
+            return "Binding";
         default:
             return "Unknown";
     }
 }
 
-static void
-lval_default(struct lval* v) {
-    v->err = NULL;
-    v->sym = NULL;
-    v->str = NULL;
+static struct lval*
+lval_alloc(int type) {
+#ifdef LISPY_GC
+    struct lval* v = lgc_alloc(LALLOC_LVAL);
+#else
+    struct lval* v = lalloc(LALLOC_LVAL);
+#endif
+    assert(v);
+    v->type = type;
+    v->refcount = 1;
+    return v;
+}
 
-    v->env = NULL;
-    v->formals = NULL;
-    v->body = NULL;
+struct lval*
+lval_num(double x) {
+    uint64_t bits;
+    if (x != x) {
+        /* Canonical quiet NaN */
+        bits = 0x7ff8000000000000;
+    } else {
+        memcpy(&bits, &x, sizeof(bits));
+    }
+    return (struct lval*)(uintptr_t)(bits + LVAL_NUM_OFFSET);
+}
 
-    v->cell = NULL;
+struct lval*
+lval_int(int64_t x) {
+    if (x >= LVAL_INT_MIN && x <= LVAL_INT_MAX) {
+        return (struct lval*)(((uintptr_t)(x - LVAL_INT_MIN) << 3) |
+                              LVAL_TAG_INT);
+    }
+    struct lval* v = lval_alloc(LVAL_INT);
+    v->integer = x;
+    return v;
 }
 
 struct lval*
-lval_num(double x) {
-    struct lval* v = malloc(sizeof(struct lval));
-    assert(v);
-    lval_default(v);
-    v->type = LVAL_NUM;
-    v->num = x;
+lval_big(struct lbig* x) {
+    int64_t i;
+    if (lbig_to_int(x, &i)) {
+        lbig_del(x);
+        return lval_int(i);
+    }
+    struct lval* v = lval_alloc(LVAL_BIG);
+    v->big = x;
+    lgc_account(v);
     return v;
 }
 
 struct lval*
 lval_err(char* fmt, ...) {
-    struct lval* v = malloc(sizeof(struct lval));
-    assert(v);
-    lval_default(v);
-    v->type = LVAL_ERR;
+    struct lval* v = lval_alloc(LVAL_ERR);
 
     va_list va;
     va_start(va, fmt);
@@ -79,6 +139,7 @@ lval_err(char* fmt, ...) {
     v->err[MAX_ERROR_LEN - 1] = '\0';
 
     v->err = realloc(v->err, strlen(v->err) + 1);
+    lgc_account(v);
 
     va_end(va);
     return v;
@@ -86,64 +147,94 @@ lval_err(char* fmt, ...) {
 
 struct lval*
 lval_sym(char* symbol) {
-    struct lval* v = malloc(sizeof(struct lval));
-    assert(v);
-    lval_default(v);
-    v->type = LVAL_SYM;
-    v->sym = strdup(symbol);
-    return v;
+    return (struct lval*)((uintptr_t)lsym_intern(symbol) | LVAL_TAG_SYM);
 }
 
 struct lval*
 lval_bool(bool value) {
-    struct lval* v = malloc(sizeof(struct lval));
-    assert(v);
-    lval_default(v);
-    v->type = LVAL_BOOL;
-    v->t = value;
-    return v;
+    return value ? LVAL_TRUE : LVAL_FALSE;
 }
 
 struct lval*
 lval_str(char* s) {
-    struct lval* v = malloc(sizeof(struct lval));
-    assert(v);
-    lval_default(v);
-    v->type = LVAL_STR;
+    struct lval* v = lval_alloc(LVAL_STR);
     v->str = strdup(s);
+    lgc_account(v);
     return v;
 }
 
 struct lval*
 lval_builtin(char* name, lbuiltin builtin) {
-    struct lval* v = malloc(sizeof(struct lval));
-    assert(v);
-    lval_default(v);
-    v->type = LVAL_FUN;
+    struct lval* v = lval_alloc(LVAL_FUN);
     v->builtin = builtin;
-    v->sym = strdup(name);
+    v->sym = lsym_intern(name);
     return v;
 }
 
 struct lval*
 lval_lambda(struct lval* formals, struct lval* body, struct lenv* par) {
-    struct lval* v = malloc(sizeof(struct lval));
-    assert(v);
-    lval_default(v);
-    v->type = LVAL_FUN;
-
+    struct lval* v = lval_alloc(LVAL_FUN);
     v->builtin = NULL;
-
-    v->env = lenv_new(par->Lispy);
     v->formals = formals;
     v->body = body;
+    v->bound = NULL;
+    v->closure_names = NULL;
+    v->closure = NULL;
+    /* The formals are bound in frames without lenv_put */
+    for (int i = 0; i < formals->count; ++i) {
+        lenv_mark_local(formals->cell[i]);
+    }
+    if (par->par) {
+        lval_capture(v, par, body);
+    }
+    v->code = lvm_enabled()
+                  ? lcode_compile(par, formals, v->closure_names, body)
+                  : NULL;
 
     return v;
 }
 
+/* Add to the closure of the lambda f the symbols of x, a part of its body,
+ * which are not formals of f and are bound in the frame e or the closure of
+ * its lambda, or not bound yet. The bindings are shared : f sees the later
+ * values given with = in these frames */
+static void
+lval_capture(struct lval* f, struct lenv* e, struct lval* x) {
+    int type = lval_type(x);
+    if (type == LVAL_SEXPR || type == LVAL_QEXPR) {
+        for (int i = 0; i < x->count; ++i) {
+            lval_capture(f, e, x->cell[i]);
+        }
+        return;
+    }
+    if (type != LVAL_SYM) {
+        return;
+    }
+    for (int i = 0; i < f->formals->count; ++i) {
+        if (f->formals->cell[i] == x) {
+            return;
+        }
+    }
+    for (int i = 0; f->closure_names && i < f->closure_names->count; ++i) {
+        if (f->closure_names->cell[i] == x) {
+            return;
+        }
+    }
+    struct lval* box = lenv_capture(e, x);
+    if (!box) {
+        return;
+    }
+    if (!f->closure) {
+        f->closure_names = lval_qexpr();
+        f->closure = lval_qexpr();
+    }
+    lval_add(f->closure_names, lval_ref(x));
+    lval_add(f->closure, box);
+}
+
 struct lval*
 lval_call(struct lenv* e, struct lval* f, struct lval* a) {
-    if (f->type != LVAL_FUN) {
+    if (lval_type(f) != LVAL_FUN) {
         struct lval* err = lval_err("Not evalutating a function");
         lval_del(a);
         return err;
@@ -154,106 +245,179 @@ lval_call(struct lenv* e, struct lval* f, struct lval* a) {
         return f->builtin(e, a);
     }
 
-    int given = a->count;
-    int total = f->formals->count;
+    struct lenv* env = lval_bind(e, f, a->cell, a->count, NULL);
+    if (!env) {
+        return lval_partial(f, a);
+    }
 
-    while (a->count > 0) {
-        if (f->formals->count == 0) {
-            lval_del(a);
-            return lval_err(
-                "Function passed too many arguments. Got %i, Expected %i",
-                given, total);
-        }
+    /* The arguments were moved to the frame */
+    a->count = 0;
+    lval_del(a);
 
-        /* Bind the argument value to the function formal symbol */
-        struct lval* sym = lval_pop(f->formals, 0);
-        /* Special case to deal with '&' */
-        if (strcmp(sym->sym, "&") == 0) {
-            /* Ensure '&' is followed by exactly one other symbol */
-            if (f->formals->count != 1) {
-                lval_del(a);
-                return lval_err(
-                    "Function format invalid. "
-                    "Symbol '&' not followed by single symbol");
-            }
+    if (f->code) {
+        return lvm_run(f, env);
+    }
+    struct lval* result = lval_eval_cells(env, f->body->cell, f->body->count);
+    lenv_del(env);
+    return result;
+}
 
-            struct lval* nsym = lval_pop(f->formals, 0);
-            /* Bind the list of var args as a Q-Expr to the symbol after '&' */
-            lenv_put(f->env, nsym, builtin_list(e, a));
-            lval_del(sym);
-            lval_del(nsym);
-            break;
+/* Index of the '&' of the formals, or -1 */
+static int
+lval_rest_index(struct lval* formals) {
+    for (int i = 0; i < formals->count; ++i) {
+        if (lval_to_sym(formals->cell[i]) == lsym_amp) {
+            return i;
         }
-        struct lval* bind_val = lval_pop(a, 0);
-
-        lenv_put(f->env, sym, bind_val);
-
-        /* Delete the popped lvals */
-        lval_del(sym);
-        lval_del(bind_val);
     }
+    return -1;
+}
 
-    lval_del(a);
+struct lenv*
+lval_bind(struct lenv* e, struct lval* f, struct lval** args, int n,
+          struct lenv* reuse) {
+    struct lval* formals = f->formals;
+    int given = f->bound ? f->bound->count : 0;
+    int rest = lval_rest_index(formals);
+    if (rest < 0 ? given + n != formals->count
+                 : formals->count != rest + 2 || given + n < rest) {
+        return NULL;
+    }
 
-    /* Case where '&' is left : we have to give an empty list as optional args
-     */
-    if (f->formals->count > 0 && strcmp(f->formals->cell[0]->sym, "&") == 0) {
-        /* Check that the function is well formed : only 1 symbol after & */
-        if (f->formals->count != 2) {
-            return lval_err(
-                "Function format invalid. "
-                "Symbol '&' not followed by single symbol.");
+    struct lenv* env = reuse;
+    if (!env) {
+        env = lenv_new_frame(e->Lispy, f);
+    } else if (env->fun != f || env->table) {
+        lenv_reset_frame(env, f);
+    }
+    for (int i = 0; i < given; ++i) {
+        lenv_set_slot(env, i, lval_ref(f->bound->cell[i]));
+    }
+    int bound = rest < 0 ? formals->count : rest;
+    for (int i = given; i < bound; ++i) {
+        lenv_set_slot(env, i, args[i - given]);
+    }
+    if (rest >= 0) {
+        struct lval* list = lval_nil();
+        if (given + n > rest) {
+            lval_del(list);
+            list = lval_qexpr();
+            lval_reserve(list, 0, given + n - rest);
+            for (int i = rest - given; i < n; ++i) {
+                lval_add(list, args[i]);
+            }
         }
+        lenv_set_slot(env, rest + 1, list);
+    }
 
-        /* Delete the '&' lval */
-        lval_del(lval_pop(f->formals, 0));
-
-        struct lval* sym = lval_pop(f->formals, 0);
-        struct lval* val = lval_qexpr();
+    if (env != reuse) {
+        env->par = e;
+    }
+    return env;
+}
 
-        lenv_put(f->env, sym, val);
-        lval_del(sym);
-        lval_del(val);
+/* Call of the lambda f that lval_bind refused : return a partial application
+ * if some formals are left, or the error of the call. f is left untouched :
+ * the new lambda shares its formals, body, code and closure, and only holds
+ * the arguments */
+static struct lval*
+lval_partial(struct lval* f, struct lval* a) {
+    struct lval* formals = f->formals;
+    int given = f->bound ? f->bound->count : 0;
+    int rest = lval_rest_index(formals);
+    if (rest >= 0 && given + a->count >= rest) {
+        /* '&' is reached but not followed by exactly one other symbol */
+        bool past = (given + a->count > rest);
+        lval_del(a);
+        return lval_err(past ? "Function format invalid. "
+                               "Symbol '&' not followed by single symbol"
+                             : "Function format invalid. "
+                               "Symbol '&' not followed by single symbol.");
+    }
+    if (given + a->count > formals->count) {
+        struct lval* err =
+            lval_err("Function passed too many arguments. Got %i, Expected %i",
+                     a->count, formals->count - given);
+        lval_del(a);
+        return err;
+    }
+    if (a->count == 0) {
+        lval_del(a);
+        return lval_ref(f);
     }
 
-    /* If all function arguments have been bound then evaluate */
-    if (f->formals->count == 0) {
-        f->env->par = e;
-        return builtin_eval(f->env, lval_add(lval_sexpr(), lval_copy(f->body)));
-    } else {
-        /* Return a copy of the function with partially bound arguments */
-        return lval_copy(f);
+    /* The arguments of f come first */
+    if (given) {
+        struct lval* bound = lval_qexpr();
+        lval_reserve(bound, 0, given + a->count);
+        for (int i = 0; i < given; ++i) {
+            lval_add(bound, lval_ref(f->bound->cell[i]));
+        }
+        for (int i = 0; i < a->count; ++i) {
+            lval_add(bound, a->cell[i]);
+        }
+        a->count = 0;
+        lval_del(a);
+        a = bound;
     }
+
+    a->type = LVAL_QEXPR;
+    struct lval* v = lval_alloc(LVAL_FUN);
+    v->builtin = NULL;
+    v->formals = lval_ref(formals);
+    v->body = lval_ref(f->body);
+    v->code = lcode_ref(f->code);
+    v->bound = a;
+    v->closure_names = f->closure ? lval_ref(f->closure_names) : NULL;
+    v->closure = f->closure ? lval_ref(f->closure) : NULL;
+    return v;
 }
 
 struct lval*
 lval_sexpr() {
-    struct lval* v = malloc(sizeof(struct lval));
-    assert(v);
-    lval_default(v);
-    v->type = LVAL_SEXPR;
+    struct lval* v = lval_alloc(LVAL_SEXPR);
     v->count = 0;
+    v->capacity = 0;
     v->cell = NULL;
+    v->block = NULL;
+    v->base = NULL;
+    v->eval_code = NULL;
     return v;
 }
 
 struct lval*
 lval_qexpr() {
-    struct lval* v = malloc(sizeof(struct lval));
-    assert(v);
-    lval_default(v);
-    v->type = LVAL_QEXPR;
+    struct lval* v = lval_alloc(LVAL_QEXPR);
     v->count = 0;
+    v->capacity = 0;
     v->cell = NULL;
+    v->block = NULL;
+    v->base = NULL;
+    v->eval_code = NULL;
     return v;
 }
 
+struct lval*
+lval_unit(void) {
+    return lval_ref(lval_unit_value);
+}
+
+struct lval*
+lval_nil(void) {
+    return lval_ref(lval_nil_value);
+}
+
+struct lval*
+lval_box(struct lval* v) {
+    struct lval* box = lval_alloc(LVAL_BOX);
+    box->boxed = v;
+    box->late = false;
+    return box;
+}
+
 struct lval*
 lval_exit_req(char* fmt, ...) {
-    struct lval* v = malloc(sizeof(struct lval));
-    assert(v);
-    lval_default(v);
-    v->type = LVAL_EXIT_REQ;
+    struct lval* v = lval_alloc(LVAL_EXIT_REQ);
 
     va_list va;
     va_start(va, fmt);
@@ -263,6 +427,7 @@ lval_exit_req(char* fmt, ...) {
     v->err[MAX_ERROR_LEN - 1] = '\0';
 
     v->err = realloc(v->err, strlen(v->err) + 1);
+    lgc_account(v);
 
     va_end(va);
     return v;
@@ -270,57 +435,116 @@ lval_exit_req(char* fmt, ...) {
 
 struct lval*
 lval_copy(struct lval* rhs) {
-    struct lval* x = malloc(sizeof(struct lval));
-    assert(x);
-    lval_default(x);
+    if (lval_is_imm(rhs)) {
+        return rhs;
+    }
 
-    x->type = rhs->type;
+    struct lval* x = lval_alloc(rhs->type);
 
     switch (rhs->type) {
         case LVAL_FUN:
             if (rhs->builtin) {
                 x->builtin = rhs->builtin;
-                x->sym = strdup(rhs->sym);
+                x->sym = rhs->sym;
             } else {
                 x->builtin = NULL;
-                x->env = lenv_copy(rhs->env);
-                x->formals = lval_copy(rhs->formals);
-                x->body = lval_copy(rhs->body);
+                x->formals = lval_ref(rhs->formals);
+                x->body = lval_ref(rhs->body);
+                x->code = lcode_ref(rhs->code);
+                x->bound = rhs->bound ? lval_ref(rhs->bound) : NULL;
+                x->closure_names =
+                    rhs->closure ? lval_ref(rhs->closure_names) : NULL;
+                x->closure = rhs->closure ? lval_ref(rhs->closure) : NULL;
             }
             break;
-        case LVAL_NUM:
-            x->num = rhs->num;
+        case LVAL_INT:
+            x->integer = rhs->integer;
+            break;
+        case LVAL_BIG:
+            x->big = lbig_copy(rhs->big);
             break;
         case LVAL_ERR:
         case LVAL_EXIT_REQ:
             x->err = strdup(rhs->err);
             break;
-        case LVAL_BOOL:
-            x->t = rhs->t;
-            break;
         case LVAL_STR:
             x->str = strdup(rhs->str);
             break;
-        case LVAL_SYM:
-            x->sym = strdup(rhs->sym);
+        case LVAL_BOX:
+            x->boxed = rhs->boxed ? lval_ref(rhs->boxed) : NULL;
+            x->late = rhs->late;
             break;
         case LVAL_SEXPR:
         case LVAL_QEXPR:
             x->count = rhs->count;
+            x->capacity = rhs->count;
             x->cell = malloc(sizeof(struct lval*) * x->count);
+            x->block = x->cell;
+            x->base = NULL;
+            x->eval_code = NULL;
             for (int i = 0; i < x->count; ++i) {
-                x->cell[i] = lval_copy(rhs->cell[i]);
+                x->cell[i] = lval_ref(rhs->cell[i]);
             }
             break;
     }
+    lgc_account(x);
+    return x;
+}
+
+struct lval*
+lval_ref(struct lval* v) {
+    if (lval_is_imm(v)) {
+        return v;
+    }
+    v->refcount++;
+    return v;
+}
+
+/* Give its own cells to a slice which is not shared */
+static void
+lval_unslice(struct lval* v) {
+    struct lval* base = v->base;
+    struct lval** cell = malloc(sizeof(struct lval*) * v->count);
+    for (int i = 0; i < v->count; ++i) {
+        cell[i] = lval_ref(v->cell[i]);
+    }
+    v->capacity = v->count;
+    v->cell = cell;
+    v->block = cell;
+    v->base = NULL;
+    lgc_account(v);
+    lval_del(base);
+}
+
+struct lval*
+lval_own(struct lval* v) {
+    if (lval_is_imm(v)) {
+        return v;
+    }
+    if (v->refcount == 1) {
+        int type = v->type;
+        if (type == LVAL_SEXPR || type == LVAL_QEXPR) {
+            if (v->base) {
+                lval_unslice(v);
+            }
+            lval_uncache(v);
+        }
+        return v;
+    }
+
+    struct lval* x = lval_copy(v);
+    lval_del(v);
     return x;
 }
 
 void
 lval_del(struct lval* v) {
+    if (lval_is_imm(v) || --v->refcount > 0) {
+        return;
+    }
     switch (v->type) {
-        case LVAL_NUM:
-        case LVAL_BOOL:
+        case LVAL_BIG:
+            lbig_del(v->big);
             break;
         case LVAL_STR:
             free(v->str);
@@ -329,32 +553,56 @@ lval_del(struct lval* v) {
         case LVAL_EXIT_REQ:
             free(v->err);
             break;
-        case LVAL_SYM:
-            free(v->sym);
-            break;
         case LVAL_QEXPR:
         case LVAL_SEXPR:
+            lcode_del(v->eval_code);
+            if (v->base) {
+                lval_del(v->base);
+                break;
+            }
             for (int i = 0; i < v->count; ++i) {
                 lval_del(v->cell[i]);
             }
-            free(v->cell);
+            free(v->block);
             break;
         case LVAL_FUN:
-            if (v->builtin) {
-                free(v->sym);
-            } else {
-                lenv_del(v->env);
+            if (!v->builtin) {
                 lval_del(v->formals);
                 lval_del(v->body);
+                lcode_del(v->code);
+                if (v->bound) {
+                    lval_del(v->bound);
+                }
+                if (v->closure) {
+                    lval_del(v->closure_names);
+                    lval_del(v->closure);
+                }
+            }
+            break;
+        case LVAL_BOX:
+            if (v->boxed) {
+                lval_del(v->boxed);
             }
             break;
     }
 
-    free(v);
+#ifdef LISPY_GC
+    lgc_free(v);
+#else
+    lfree(v);
+#endif
 }
 
 struct lval*
 lval_read_num(mpc_ast_t* t) {
+    /* Literals without a decimal part or an exponent are integers */
+    if (!strpbrk(t->contents, ".eE")) {
+        errno = 0;
+        long long i = strtoll(t->contents, NULL, 10);
+        return errno != ERANGE ? lval_int(i)
+                               : lval_big(lbig_from_string(t->contents));
+    }
+
     errno = 0;
     double x = strtod(t->contents, NULL);
     return errno != ERANGE ? lval_num(x) : lval_err("invalid number");
@@ -426,71 +674,145 @@ lval_read(mpc_ast_t* t) {
     return x;
 }
 
+void
+lval_uncache(struct lval* v) {
+    if (v->eval_code) {
+        lcode_del(v->eval_code);
+        v->eval_code = NULL;
+    }
+}
+
 struct lval*
 lval_add(struct lval* v, struct lval* new_subexpr) {
     if (NULL == new_subexpr) {
         return v;
     }
-    v->count++;
-    v->cell = realloc(v->cell, sizeof(struct lval*) * v->count);
-    v->cell[v->count - 1] = new_subexpr;
+    lval_uncache(v);
+    lval_reserve(v, 0, 1);
+    v->cell[v->count++] = new_subexpr;
     return v;
 }
 
+void
+lval_reserve(struct lval* v, int front, int back) {
+    if (v->base) {
+        lval_unslice(v);
+    }
+    int before = v->cell - v->block;
+    int after = v->capacity - before - v->count;
+    if (before >= front && after >= back) {
+        return;
+    }
+
+    /* The free slots grow geometrically, so that adding cells one by one at
+     * either end takes amortized constant time */
+    if (before < front) {
+        before = front + v->count;
+    }
+    if (after < back) {
+        after = back + v->count;
+    }
+    int capacity = before + v->count + after;
+    struct lval** block = malloc(sizeof(struct lval*) * capacity);
+    if (v->count > 0) {
+        memcpy(block + before, v->cell, sizeof(struct lval*) * v->count);
+    }
+    free(v->block);
+    v->block = block;
+    v->cell = block + before;
+    v->capacity = capacity;
+    lgc_account(v);
+}
+
+struct lval*
+lval_slice(struct lval* v, int start) {
+    struct lval* x = lval_sexpr();
+    x->type = v->type;
+    x->count = v->count - start;
+    x->cell = v->cell + start;
+    if (v->base) {
+        /* Slices always point to a list with a block */
+        x->base = lval_ref(v->base);
+        lval_del(v);
+    } else {
+        x->base = v;
+    }
+    return x;
+}
+
 struct lval*
 lval_take(struct lval* v, int index) {
-    struct lval* x = lval_pop(v, index);
+    struct lval* x;
+    int type = lval_type(v);
+    if ((type == LVAL_SEXPR || type == LVAL_QEXPR) && index < v->count) {
+        /* v is deleted right after, so there is no need to remove the cell,
+         * and v does not need to be owned */
+        x = lval_ref(v->cell[index]);
+    } else {
+        x = lval_pop(v, index);
+    }
     lval_del(v);
     return x;
 }
 
 struct lval*
 lval_pop(struct lval* v, int index) {
-    if (v->type != LVAL_SEXPR && v->type != LVAL_QEXPR) {
+    int type = lval_type(v);
+    if (type != LVAL_SEXPR && type != LVAL_QEXPR) {
         return lval_err("Value is neither a S-expr nor a Q-expr");
     }
     if (index >= v->count) {
         return lval_err("{Q,S}-expression does not have so many sub expr");
     }
+    if (v->base) {
+        lval_unslice(v);
+    }
+    lval_uncache(v);
     struct lval* ans = v->cell[index];
 
-    memmove(&v->cell[index], &v->cell[index + 1],
-            sizeof(struct lval*) * (v->count - index - 1));
-
+    /* The first cell is dropped by moving the start of the list */
+    if (index == 0) {
+        v->cell++;
+    } else {
+        memmove(&v->cell[index], &v->cell[index + 1],
+                sizeof(struct lval*) * (v->count - index - 1));
+    }
     v->count--;
-
-    v->cell = realloc(v->cell, sizeof(struct lval*) * v->count);
     return ans;
 }
 
-static struct lval*
-lval_eval_sexpr(struct lenv* e, struct lval* v) {
-    /* Evaluate each cell */
-    for (int i = 0; i < v->count; i++) {
-        v->cell[i] = lval_eval(e, v->cell[i]);
+struct lval*
+lval_eval_cells(struct lenv* e, struct lval** cells, int count) {
+    if (count == 0) {
+        return lval_unit();
+    }
+    /* A single value is not called */
+    if (count == 1) {
+        return lval_eval_borrowed(e, cells[0]);
+    }
+    if (lvm_stack_exhausted()) {
+        return lvm_stack_error();
+    }
+
+    /* The values go to a new list, the cells are left untouched */
+    struct lval* v = lval_sexpr();
+    lval_reserve(v, 0, count);
+    for (int i = 0; i < count; i++) {
+        v->cell[i] = lval_eval_borrowed(e, cells[i]);
+        v->count++;
     }
 
     /* Check that no cell had an error */
     for (int i = 0; i < v->count; ++i) {
-        if (v->cell[i]->type == LVAL_ERR) {
+        if (lval_type(v->cell[i]) == LVAL_ERR) {
             return lval_take(v, i);
         }
     }
 
-    /* Return itself if v contains no sub-expr */
-    if (v->count == 0) {
-        return v;
-    }
-
-    /* Return the inner sigleton for small S-Expr */
-    if (v->count == 1) {
-        return lval_take(v, 0);
-    }
-
     /* Here we know we have a 'long' S-Expression, so it must start with a
      * function */
     struct lval* f = lval_pop(v, 0);
-    if (f->type != LVAL_FUN) {
+    if (lval_type(f) != LVAL_FUN) {
         lval_del(f);
         lval_del(v);
         return lval_err("S-expression does not start with a function !");
@@ -501,31 +823,44 @@ lval_eval_sexpr(struct lenv* e, struct lval* v) {
     return result;
 }
 
+struct lval*
+lval_eval_borrowed(struct lenv* e, struct lval* v) {
+    if (lval_is_imm(v)) {
+        return lval_type(v) == LVAL_SYM ? lenv_get(e, v) : v;
+    }
+
+    /* The empty S-expression is its own value */
+    if (v->type == LVAL_SEXPR && v->count > 0) {
+        return lval_eval_cells(e, v->cell, v->count);
+    }
+    return lval_ref(v);
+}
+
 struct lval*
 lval_eval(struct lenv* e, struct lval* v) {
-    if (v->type == LVAL_SYM) {
-        struct lval* x = lenv_get(e, v);
-        lval_del(v);
-        return x;
+    if (lval_is_imm(v)) {
+        return lval_type(v) == LVAL_SYM ? lenv_get(e, v) : v;
     }
 
-    if (v->type == LVAL_SEXPR) {
-        return lval_eval_sexpr(e, v);
+    if (v->type == LVAL_SEXPR && v->count > 0) {
+        struct lval* result = lval_eval_cells(e, v->cell, v->count);
+        lval_del(v);
+        return result;
     }
     return v;
 }
 
 static void
-lval_print_str(struct lval* v) {
+lval_print_str(FILE* out, struct lval* v) {
     char* escaped = strdup(v->str);
     escaped = mpcf_escape(escaped);
-    printf("\"%s\"", escaped);
+    fprintf(out, "\"%s\"", escaped);
     free(escaped);
 }
 
 void
 lval_show(struct lval* v) {
-    switch (v->type) {
+    switch (lval_type(v)) {
         case LVAL_STR:
             printf("%s", v->str);
             break;
@@ -538,48 +873,67 @@ lval_show(struct lval* v) {
 
 void
 lval_print(struct lval* v) {
-    switch (v->type) {
+    lval_fprint(stdout, v);
+}
+
+void
+lval_fprint(FILE* out, struct lval* v) {
+    switch (lval_type(v)) {
         case LVAL_NUM:
-            printf("%g", v->num);
+            fprintf(out, "%g", lval_to_num(v));
             break;
 
+        case LVAL_INT:
+            fprintf(out, "%" PRId64, lval_to_int(v));
+            break;
+
+        case LVAL_BIG: {
+            char* digits = lbig_to_string(v->big);
+            fprintf(out, "%s", digits);
+            free(digits);
+            break;
+        }
+
         case LVAL_STR:
-            lval_print_str(v);
+            lval_print_str(out, v);
             break;
 
         case LVAL_BOOL:
-            printf("%s", v->t ? "t" : "f");
+            fprintf(out, "%s", lval_to_bool(v) ? "t" : "f");
             break;
 
         case LVAL_ERR:
-            printf("Error : %s", v->err);
+            fprintf(out, "Error : %s", v->err);
             break;
 
         case LVAL_EXIT_REQ:
-            printf("Exit request : %s", v->err);
+            fprintf(out, "Exit request : %s", v->err);
             break;
 
         case LVAL_SYM:
-            printf("%s", v->sym);
+            fprintf(out, "%s", lval_to_sym(v));
             break;
 
         case LVAL_SEXPR:
-            lval_expr_print(v, '(', ')');
+            lval_cells_print(out, v->cell, v->count, '(', ')');
             break;
 
         case LVAL_QEXPR:
-            lval_expr_print(v, '{', '}');
+            lval_cells_print(out, v->cell, v->count, '{', '}');
             break;
 
         case LVAL_FUN:
             if (v->builtin) {
-                printf("<builtin> : %s", v->sym);
+                fprintf(out, "<builtin> : %s", v->sym);
             } else {
-                printf("(\\ ");
-                lval_print(v->formals);
-                putchar(' ');
-                lval_print(v->body);
-                putchar(')');
+                /* A partial application shows the formals left */
+                int given = v->bound ? v->bound->count : 0;
+                fprintf(out, "(\\ ");
+                lval_cells_print(out, v->formals->cell + given,
+                                 v->formals->count - given, '{', '}');
+                fputc(' ', out);
+                lval_fprint(out, v->body);
+                fputc(')', out);
             }
             break;
     }
@@ -587,15 +941,21 @@ lval_print(struct lval* v) {
 
 void
 lval_expr_print(struct lval* v, char open, char close) {
-    putchar(open);
-    for (int i = 0; i < v->count; ++i) {
-        lval_print(v->cell[i]);
+    lval_cells_print(stdout, v->cell, v->count, open, close);
+}
 
-        if (i != v->count - 1) {
-            putchar(' ');
+static void
+lval_cells_print(FILE* out, struct lval** cells, int count, char open,
+                 char close) {
+    fputc(open, out);
+    for (int i = 0; i < count; ++i) {
+        lval_fprint(out, cells[i]);
+
+        if (i != count - 1) {
+            fputc(' ', out);
         }
     }
-    putchar(close);
+    fputc(close, out);
 }
 
 void
@@ -604,29 +964,83 @@ lval_println(struct lval* v) {
     putchar('\n');
 }
 
+int
+lval_cmp_int_num(struct lval* x, double d) {
+    if (lval_type(x) == LVAL_INT) {
+        if (d < -0x1p63) {
+            return 1;
+        }
+        if (d >= 0x1p63) {
+            return -1;
+        }
+        /* Compare to the integer part of d, then to its fraction */
+        int64_t i = lval_to_int(x);
+        int64_t t = (int64_t)d;
+        if (i != t) {
+            return (i > t) - (i < t);
+        }
+        return (d < (double)t) - (d > (double)t);
+    }
+
+    /* A big integer is out of the range of an int64, where every double is
+     * an integer : the integer part of d is enough */
+    if (isinf(d)) {
+        return d < 0 ? 1 : -1;
+    }
+    struct lbig* t = lbig_from_double(d);
+    int cmp = lbig_cmp(x->big, t);
+    lbig_del(t);
+    return cmp;
+}
+
 bool
 lval_eq(struct lval* x, struct lval* y) {
-    if (x->type != y->type) {
+    int type = lval_type(x);
+    if (type != lval_type(y)) {
+        /* Integers and numbers with the same value are equal */
+        if (type == LVAL_NUM) {
+            struct lval* tmp = x;
+            x = y;
+            y = tmp;
+        }
+        if ((lval_type(x) == LVAL_INT || lval_type(x) == LVAL_BIG) &&
+            lval_type(y) == LVAL_NUM) {
+            double d = lval_to_num(y);
+            return d == d && lval_cmp_int_num(x, d) == 0;
+        }
         return false;
     }
 
-    switch (x->type) {
+    switch (type) {
         case LVAL_ERR:
             return (strcmp(x->err, y->err) == 0);
         case LVAL_SYM:
-            return (strcmp(x->sym, y->sym) == 0);
-        case LVAL_NUM:
-            return (x->num == y->num);
         case LVAL_BOOL:
-            return (x->t == y->t);
+            return (x == y);
+        case LVAL_NUM:
+            return (lval_to_num(x) == lval_to_num(y));
+        case LVAL_INT:
+            return (lval_to_int(x) == lval_to_int(y));
+        case LVAL_BIG:
+            return lbig_cmp(x->big, y->big) == 0;
         case LVAL_STR:
             return (strcmp(x->str, y->str) == 0);
+        case LVAL_BOX:
+            return (x->boxed && y->boxed) ? lval_eq(x->boxed, y->boxed)
+                                          : (x->boxed == y->boxed);
         case LVAL_FUN:
             if (x->builtin || y->builtin) {
                 return (x->builtin == y->builtin);
             } else {
+                struct lval* empty = lval_nil_value;
                 return lval_eq(x->formals, y->formals) &&
-                       lval_eq(x->body, y->body);
+                       lval_eq(x->body, y->body) &&
+                       lval_eq(x->bound ? x->bound : empty,
+                               y->bound ? y->bound : empty) &&
+                       lval_eq(x->closure ? x->closure_names : empty,
+                               y->closure ? y->closure_names : empty) &&
+                       lval_eq(x->closure ? x->closure : empty,
+                               y->closure ? y->closure : empty);
             }
         case LVAL_QEXPR:
         case LVAL_SEXPR:
@@ -2,54 +2,256 @@
 #define LVAL_H_
 
 #include "evaluation.h"
+#include "lbig.h"
 #include "mpc.h"
 
 #include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
 
 struct lval;
 struct lenv;
+struct lcode;
 typedef struct lval* (*lbuiltin)(struct lenv*, struct lval*);
 
 enum {
     LVAL_ERR,
     LVAL_NUM,
+    LVAL_INT,
+    LVAL_BIG,
     LVAL_SYM,
     LVAL_BOOL,
     LVAL_STR,
     LVAL_FUN,
     LVAL_SEXPR,
     LVAL_QEXPR,
-    LVAL_EXIT_REQ
+    LVAL_EXIT_REQ,
+    /* Binding of a frame shared with the closures capturing it, never the
+     * value of an expression, see lenv_capture */
+    LVAL_BOX
 };
 enum { LERR_DIV_ZERO, LERR_BAD_OP, LERR_BAD_NUM };
 
+/** Values are tagged unions : type tells which member of the union is valid.
+ *
+ * The layout keeps every value in 48 bytes, the size of a slot of lalloc.h.
+ * The builtin name shares its slot with the lambda fields, and lambdas are
+ * told apart from builtins by a NULL builtin pointer.
+ *
+ * Values are reference counted and shared : environments, lists and functions
+ * hold references (see lval_ref), and lval_del only frees a value when its
+ * last reference is dropped. A value must not be mutated while it is shared,
+ * so code that modifies a value (lval_add, lval_pop, changing its type...)
+ * first gets a private version of it with lval_own.
+ *
+ * Numbers, booleans and symbols are not allocated : they are immediates
+ * stored in the 64 bits of the struct lval* itself, which must then not be
+ * dereferenced. Use lval_type and the lval_to_* accessors to read any value.
+ * - Heap values are pointers aligned on 16 bytes, below 2^48.
+ * - Integers between LVAL_INT_MIN and LVAL_INT_MAX are shifted and tagged
+ *   with LVAL_TAG_INT in the low bits. Other int64 are heap LVAL_INT, and
+ *   integers that do not fit in an int64 are LVAL_BIG (see lbig.h).
+ * - Symbols are their interned name (aligned by malloc) tagged with
+ *   LVAL_TAG_SYM in the low bits.
+ * - Booleans are the constants LVAL_FALSE and LVAL_TRUE.
+ * - Numbers are the bits of the double plus LVAL_NUM_OFFSET, which puts them
+ *   above every pointer (NaN-boxing). NaNs are made canonical so the sum
+ *   never overflows.
+ * Immediates have no reference count : lval_ref, lval_own and lval_del
+ * return or ignore them.
+ *
+ * The empty S-expression returned by builtins and nil, the empty
+ * Q-expression, are shared constants created by lval_init (see lval_unit
+ * and lval_nil). Their reference count starts at LVAL_IMMORTAL, so lval_del
+ * never frees them and lval_own always copies them.
+ */
 struct lval {
     int type;
-
-    /* Basic */
-    double num;
-    char* err;
-    char* sym;
-    char* str;
-    bool t;
-
-    /* Function */
-    lbuiltin builtin;
-    struct lenv* env;
-    struct lval* formals;
-    struct lval* body;
-
-    /* X-Expression */
-    int count;
-    struct lval** cell;
+    int refcount;
+
+    union {
+        /* LVAL_INT too large to be an immediate */
+        int64_t integer;
+
+        /* LVAL_BIG, never in the range of an int64 */
+        struct lbig* big;
+
+        /* LVAL_ERR, LVAL_EXIT_REQ */
+        char* err;
+
+        /* LVAL_STR */
+        char* str;
+
+        /* LVAL_FUN */
+        struct {
+            lbuiltin builtin; /* NULL for lambdas */
+            union {
+                /* Builtins.
+                 * Interned with lsym_intern, never freed by lval_del */
+                char* sym;
+
+                /* Lambdas. A partial application shares the formals, body,
+                 * code and closure of the lambda it applies */
+                struct {
+                    struct lval* formals;
+                    struct lval* body;
+                    /* Compiled body, NULL to evaluate the body */
+                    struct lcode* code;
+                    /* Arguments of a partial application, bound to the first
+                     * formals, NULL for other lambdas */
+                    struct lval* bound;
+                    /* Flat closure : the free symbols of the body bound in
+                     * the frame creating the lambda, and the LVAL_BOX of
+                     * their bindings. NULL if there is none */
+                    struct lval* closure_names;
+                    struct lval* closure;
+                };
+            };
+        };
+
+        /* LVAL_BOX */
+        struct {
+            /* Value of the binding, NULL while the name is unbound */
+            struct lval* boxed;
+            /* Made before the name was bound, see lenv_capture */
+            bool late;
+        };
+
+        /* LVAL_SEXPR, LVAL_QEXPR.
+         * The cells live in block, which has room for capacity cells, and
+         * may have free slots before the first one so that tail and join
+         * do not move the others. A slice (see builtin_tail) has no block :
+         * its cells belong to base, which it keeps alive, and it is turned
+         * back into a regular list by lval_own before being mutated */
+        struct {
+            int count;
+            int capacity;
+            struct lval** cell;
+            struct lval** block;
+            struct lval* base;
+            /* Code of the list evaluated by eval or cond in a lambda body,
+             * NULL until then (see lcode_compile_eval). It is dropped by
+             * lval_uncache when the cells change */
+            struct lcode* eval_code;
+        };
+    };
 };
 
+_Static_assert(sizeof(void*) == 8, "Immediate values need 64 bits pointers");
+
+#define LVAL_NUM_OFFSET ((uintptr_t)1 << 49)
+#define LVAL_TAG_MASK ((uintptr_t)0x7)
+#define LVAL_TAG_INT ((uintptr_t)0x1)
+#define LVAL_TAG_SYM ((uintptr_t)0x2)
+#define LVAL_TAG_BOOL ((uintptr_t)0x6)
+#define LVAL_FALSE ((struct lval*)LVAL_TAG_BOOL)
+#define LVAL_TRUE ((struct lval*)(0x8 | LVAL_TAG_BOOL))
+
+/* Immediate integers have 46 bits, so that they stay below LVAL_NUM_OFFSET */
+#define LVAL_INT_MIN (-((int64_t)1 << 45))
+#define LVAL_INT_MAX (((int64_t)1 << 45) - 1)
+
+/* True if v is a number, a boolean or a symbol */
+static inline bool
+lval_is_imm(struct lval* v) {
+    return (uintptr_t)v >= LVAL_NUM_OFFSET || ((uintptr_t)v & LVAL_TAG_MASK);
+}
+
+static inline int
+lval_type(struct lval* v) {
+    if ((uintptr_t)v >= LVAL_NUM_OFFSET) {
+        return LVAL_NUM;
+    }
+    switch ((uintptr_t)v & LVAL_TAG_MASK) {
+        case 0:
+            return v->type;
+        case LVAL_TAG_INT:
+            return LVAL_INT;
+        case LVAL_TAG_SYM:
+            return LVAL_SYM;
+        default:
+            return LVAL_BOOL;
+    }
+}
+
+/* Value of a LVAL_NUM */
+static inline double
+lval_to_num(struct lval* v) {
+    uint64_t bits = (uintptr_t)v - LVAL_NUM_OFFSET;
+    double x;
+    memcpy(&x, &bits, sizeof(x));
+    return x;
+}
+
+/* Value of a LVAL_INT */
+static inline int64_t
+lval_to_int(struct lval* v) {
+    if ((uintptr_t)v & LVAL_TAG_INT) {
+        return (int64_t)((uintptr_t)v >> 3) + LVAL_INT_MIN;
+    }
+    return v->integer;
+}
+
+/* True for LVAL_NUM, LVAL_INT and LVAL_BIG */
+static inline bool
+lval_is_number(struct lval* v) {
+    int type = lval_type(v);
+    return type == LVAL_NUM || type == LVAL_INT || type == LVAL_BIG;
+}
+
+/* Value of a LVAL_NUM, LVAL_INT or LVAL_BIG, as a double */
+static inline double
+lval_to_double(struct lval* v) {
+    switch (lval_type(v)) {
+        case LVAL_INT:
+            return (double)lval_to_int(v);
+        case LVAL_BIG:
+            return lbig_to_double(v->big);
+        default:
+            return lval_to_num(v);
+    }
+}
+
+/* Value of a LVAL_BOOL */
+static inline bool
+lval_to_bool(struct lval* v) {
+    return v == LVAL_TRUE;
+}
+
+/* Interned name of a LVAL_SYM */
+static inline char*
+lval_to_sym(struct lval* v) {
+    return (char*)((uintptr_t)v - LVAL_TAG_SYM);
+}
+
+/* Value bound by v if it is a LVAL_BOX, else v, which must not be NULL */
+static inline struct lval*
+lval_unbox(struct lval* v) {
+    return (!lval_is_imm(v) && v->type == LVAL_BOX) ? v->boxed : v;
+}
+
+/* Reference count of the shared constants */
+#define LVAL_IMMORTAL (1 << 30)
+
+/* Create the shared constants, once the allocator is ready */
+void lval_init(void);
+
+/* Free the shared constants */
+void lval_cleanup(void);
+
 /* Return a string with human-readable type name */
 char* ltype_name(int type);
 
 /* Create a new lval from a number */
 struct lval* lval_num(double x);
 
+/* Create a new lval from an integer */
+struct lval* lval_int(int64_t x);
+
+/* Create a new lval from a big integer, which it takes. The result is a
+ * LVAL_INT if x fits in an int64 */
+struct lval* lval_big(struct lbig* x);
+
 /* Create a new lval from an error */
 struct lval* lval_err(char* fmt, ...);
 
@@ -65,52 +267,119 @@ struct lval* lval_str(char* s);
 /* Create a new lval from a builtin function */
 struct lval* lval_builtin(char* name, lbuiltin builtin);
 
-/* Create a new lval from a lambda function */
+/* Create a new lval from a lambda function, created in the environment par.
+ * If par is the frame of a call, the bindings of the free symbols of the body
+ * in par or in the closure of its lambda are captured in the closure of the
+ * new one, and the names that are not bound yet are bound late in par (see
+ * lenv_capture). The other ones are looked up in the global environment */
 struct lval* lval_lambda(struct lval* formals, struct lval* body,
                          struct lenv* par);
 
-/* Create a new lval from calling a lambda function */
+/* Create a new lval from calling the function f with the arguments a, which
+ * are consumed. f is not modified : the arguments of a lambda are bound in a
+ * new environment, the frame of the call, and a partial application returns
+ * a new lambda holding the arguments in its bound list */
 struct lval* lval_call(struct lenv* e, struct lval* f, struct lval* a);
 
+/* Bind the arguments of a partial application f, then the n arguments, to
+ * the formals of the lambda f in the frame of a call from e, and take them.
+ * Return NULL, without taking the arguments, if the call does not bind every
+ * formal exactly once.
+ *
+ * The frame is a new environment sized to the formals, whose parent is e, or
+ * reuse if it is given : the frame of a call which is done, the last one
+ * created, which keeps its parent.
+ */
+struct lenv* lval_bind(struct lenv* e, struct lval* f, struct lval** args,
+                       int n, struct lenv* reuse);
+
 /* Create a new lval from an empty sexpr */
 struct lval* lval_sexpr();
 
 /* Create a new lval from an empty qexpr */
 struct lval* lval_qexpr();
 
+/* Get a reference to the shared empty sexpr, the result of builtins that
+ * return nothing */
+struct lval* lval_unit(void);
+
+/* Get a reference to the shared empty qexpr */
+struct lval* lval_nil(void);
+
+/* Create a binding for a closure, holding v which it takes, or NULL */
+struct lval* lval_box(struct lval* v);
+
 /* Create a new lval from an exit request */
 struct lval* lval_exit_req(char* fmt, ...);
 
-/* Free an lval */
+/* Drop a reference to an lval, and free it if it was the last one */
 void lval_del(struct lval* v);
 
-/* Copy an lval */
+/* Take a new reference to an lval */
+struct lval* lval_ref(struct lval* v);
+
+/* Copy the top level of an lval. The children (cells, formals, body and the
+ * values in the environment of a lambda) are shared with rhs
+ */
 struct lval* lval_copy(struct lval* rhs);
 
+/* Consume a reference to v, and return a version of v that is only owned by
+ * the caller and can be mutated : v itself if it was not shared, a copy
+ * otherwise. A slice gets cells of its own
+ */
+struct lval* lval_own(struct lval* v);
+
 /* Read a num from a tree */
 struct lval* lval_read_num(mpc_ast_t* t);
 
 /* Read a lval from a tree */
 struct lval* lval_read(mpc_ast_t* t);
 
-/* Add a lval to the Sexpr */
+/* Drop the code compiled for the list v, before its cells change */
+void lval_uncache(struct lval* v);
+
+/* Add a lval to the Sexpr, v must not be shared */
 struct lval* lval_add(struct lval* v, struct lval* new_subexpr);
 
+/* Make room for front cells before the first one and back cells after the
+ * last one, without changing count. v must not be shared */
+void lval_reserve(struct lval* v, int front, int back);
+
+/* Create a slice of the list v, which shares its cells from start on.
+ * Consume v */
+struct lval* lval_slice(struct lval* v, int start);
+
 /* Take a sub expression in a Sexpr and delete the rest */
 struct lval* lval_take(struct lval* v, int index);
 
-/* Pop a sub expression in a Sexpr */
+/* Pop a sub expression in a Sexpr, v must not be shared */
 struct lval* lval_pop(struct lval* v, int index);
 
-/* Return the eval expression, itself otherwise */
+/* Return the eval expression, itself otherwise. v is consumed */
 struct lval* lval_eval(struct lenv* e, struct lval* v);
 
+/* Same as lval_eval, without consuming v : v is neither modified nor freed,
+ * so it may be shared. The caller keeps it alive during the evaluation */
+struct lval* lval_eval_borrowed(struct lenv* e, struct lval* v);
+
+/* Evaluate the cells of a S-expression, without consuming them. The cells of
+ * a Q-expression (a lambda body, a branch of cond, the argument of eval...)
+ * are evaluated this way, instead of being copied to a S-expression */
+struct lval* lval_eval_cells(struct lenv* e, struct lval** cells, int count);
+
+/* Compare exactly the integer x, a LVAL_INT or LVAL_BIG, and d, which is not
+ * NaN : return -1, 0 or 1 when x is lower, equal or greater than d */
+int lval_cmp_int_num(struct lval* x, double d);
+
 /* Equality operator */
 bool lval_eq(struct lval* x, struct lval* y);
 
 /* Print an lval */
 void lval_print(struct lval* v);
 
+/* Print an lval to out */
+void lval_fprint(FILE* out, struct lval* v);
+
 /* Show an lval 
  * This function is only different for LVAL_STR, this one inteprets escape
  * sequences
@@ -0,0 +1,863 @@
+#include "lvm.h"
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+
+#include "evaluation.h"
+#include "lcode.h"
+#include "lenv.h"
+#include "lsym.h"
+#include "ltable.h"
+
+#define LVM_INITIAL_STACK 1024
+#define LVM_INITIAL_FRAMES 64
+
+/* Frames allowed when LISPY_MAX_DEPTH is not set. A frame with its
+ * environment takes a few hundred bytes */
+#define LVM_DEFAULT_MAX_DEPTH (1 << 22)
+
+/* C stack kept free for the builtins called by the deepest evaluation */
+#define LVM_STACK_MARGIN (256 * 1024)
+/* C stack assumed when its size is not limited */
+#define LVM_UNLIMITED_STACK (64 * 1024 * 1024)
+
+/* Threaded dispatch needs the labels as values extension of GCC. Define
+ * LVM_SWITCH to use the switch anyway, to compare both */
+#if defined(__GNUC__) && !defined(LVM_SWITCH)
+#define LVM_THREADED
+#endif
+
+/* Number of opcode pairs printed by the profiler */
+#define LVM_PROFILE_PAIRS 20
+
+struct lvm_frame {
+    /* Reference to the value which keeps the constants of the code alive :
+     * the lambda, or the Q-expression given to eval */
+    struct lval* fun;
+    /* Reference to the code */
+    struct lcode* code;
+    int pc;
+
+    /* First stack slot of the frame */
+    int base;
+
+    struct lenv* env;
+    /* Environments deleted when the frame returns : env and the ones of the
+     * frames it replaced with tail calls, which are its parents */
+    int envs;
+};
+
+static _Thread_local struct {
+    struct lval** stack;
+    int sp;
+    int stack_size;
+
+    struct lvm_frame* frames;
+    int frame_count;
+    int frame_size;
+
+    /* Top of the C stack of the thread, and the part of it evaluations may
+     * use */
+    uintptr_t c_stack_top;
+    size_t c_stack_size;
+} lvm;
+
+static bool lvm_disabled;
+static int lvm_max_depth = LVM_DEFAULT_MAX_DEPTH;
+
+/* Built with -DLVM_PROFILE (make VM_PROFILE=1), the VM counts how many times
+ * each opcode follows each other one, and prints the most frequent pairs on
+ * exit : these are the candidates for superinstructions */
+#ifdef LVM_PROFILE
+static _Thread_local struct {
+    unsigned long pairs[LOP_COUNT][LOP_COUNT];
+    int previous;
+} lvm_profile;
+#define LVM_COUNT_PAIR(op)                             \
+    do {                                               \
+        lvm_profile.pairs[lvm_profile.previous][op]++; \
+        lvm_profile.previous = (op);                   \
+    } while (0)
+static void lvm_print_profile(void);
+#else
+#define LVM_COUNT_PAIR(op) ((void)0)
+#endif
+
+/* Fallbacks of the opcodes of binary builtins, indexed from LOP_ADD */
+static const lbuiltin lvm_binary_builtins[] = {
+    builtin_add, builtin_sub, builtin_mul, builtin_div,
+    builtin_mod, builtin_eq,  builtin_ne,  builtin_gt,
+    builtin_ge,  builtin_lt,  builtin_le,
+};
+
+static void lvm_push_frame(struct lval* f, struct lcode* code,
+                           struct lenv* env, int envs);
+static struct lval* lvm_depth_error(void);
+static struct lval* lvm_eval_arg(struct lval** args, int n);
+static void lvm_reserve(int slots);
+static struct lval* lvm_execute(int first);
+static struct lval* lvm_error(struct lval** values, int n);
+static struct lval* lvm_sexpr(struct lval** values, int n);
+static struct lval* lvm_cond_error(struct lval* test);
+static struct lval* lvm_binary(struct lenv* e, int op, struct lval* x,
+                               struct lval* y);
+
+void
+lvm_init(void) {
+    lvm_disabled = (getenv("LISPY_NO_VM") != NULL);
+    char* max_depth = getenv("LISPY_MAX_DEPTH");
+    if (max_depth && atoi(max_depth) > 0) {
+        lvm_max_depth = atoi(max_depth);
+    }
+
+    /* The caller is close to the top of the stack */
+    char top;
+    struct rlimit limit;
+    lvm.c_stack_top = (uintptr_t)&top;
+    lvm.c_stack_size = LVM_UNLIMITED_STACK;
+    if (getrlimit(RLIMIT_STACK, &limit) == 0 &&
+        limit.rlim_cur != RLIM_INFINITY) {
+        lvm.c_stack_size = limit.rlim_cur;
+    }
+    lvm.c_stack_size = lvm.c_stack_size > 2 * LVM_STACK_MARGIN
+                           ? lvm.c_stack_size - LVM_STACK_MARGIN
+                           : lvm.c_stack_size / 2;
+
+    lvm.stack = malloc(LVM_INITIAL_STACK * sizeof(struct lval*));
+    lvm.stack_size = LVM_INITIAL_STACK;
+    lvm.sp = 0;
+    lvm.frames = malloc(LVM_INITIAL_FRAMES * sizeof(struct lvm_frame));
+    lvm.frame_size = LVM_INITIAL_FRAMES;
+    lvm.frame_count = 0;
+    assert(lvm.stack && lvm.frames);
+}
+
+bool
+lvm_enabled(void) {
+    return !lvm_disabled;
+}
+
+bool
+lvm_stack_exhausted(void) {
+    /* The stack grows down */
+    char here;
+    return lvm.c_stack_top - (uintptr_t)&here > lvm.c_stack_size;
+}
+
+struct lval*
+lvm_stack_error(void) {
+    return lval_err("Stack overflow : expressions are nested too deeply");
+}
+
+void
+lvm_cleanup(void) {
+#ifdef LVM_PROFILE
+    lvm_print_profile();
+#endif
+    free(lvm.stack);
+    free(lvm.frames);
+    lvm.stack = NULL;
+    lvm.frames = NULL;
+}
+
+#ifdef LVM_PROFILE
+static void
+lvm_print_profile(void) {
+    unsigned long total = 0;
+    for (int i = 0; i < LOP_COUNT; ++i) {
+        for (int j = 0; j < LOP_COUNT; ++j) {
+            total += lvm_profile.pairs[i][j];
+        }
+    }
+    fprintf(stderr, "VM : %lu instructions\n", total);
+
+    /* Selection of the most frequent pairs, the table is small */
+    bool printed[LOP_COUNT][LOP_COUNT] = {{false}};
+    for (int k = 0; k < LVM_PROFILE_PAIRS; ++k) {
+        int first = -1;
+        int second = -1;
+        for (int i = 0; i < LOP_COUNT; ++i) {
+            for (int j = 0; j < LOP_COUNT; ++j) {
+                if (!printed[i][j] &&
+                    (first < 0 || lvm_profile.pairs[i][j] >
+                                      lvm_profile.pairs[first][second])) {
+                    first = i;
+                    second = j;
+                }
+            }
+        }
+        unsigned long count = lvm_profile.pairs[first][second];
+        if (count == 0) {
+            break;
+        }
+        printed[first][second] = true;
+        fprintf(stderr, "VM : %-28s %-28s %10lu %5.1f%%\n",
+                lcode_op_name(first), lcode_op_name(second), count,
+                100.0 * count / total);
+    }
+}
+#endif
+
+struct lval*
+lvm_run(struct lval* f, struct lenv* env) {
+    struct lval* err = NULL;
+    if (lvm_stack_exhausted()) {
+        err = lvm_stack_error();
+    } else if (lvm.frame_count >= lvm_max_depth) {
+        err = lvm_depth_error();
+    }
+    if (err) {
+        lenv_del(env);
+        return err;
+    }
+    lvm_push_frame(lval_ref(f), lcode_ref(f->code), env, 1);
+    return lvm_execute(lvm.frame_count - 1);
+}
+
+/* Push a frame running code, kept alive by f. Both references are taken */
+static void
+lvm_push_frame(struct lval* f, struct lcode* code, struct lenv* env,
+               int envs) {
+    if (lvm.frame_count == lvm.frame_size) {
+        lvm.frame_size *= 2;
+        lvm.frames =
+            realloc(lvm.frames, lvm.frame_size * sizeof(struct lvm_frame));
+        assert(lvm.frames);
+    }
+    lvm_reserve(code->max_stack);
+
+    struct lvm_frame* fr = &lvm.frames[lvm.frame_count++];
+    fr->fun = f;
+    fr->code = code;
+    fr->pc = 0;
+    fr->base = lvm.sp;
+    fr->env = env;
+    fr->envs = envs;
+}
+
+/* Make room for slots values above the top of the stack */
+static void
+lvm_reserve(int slots) {
+    if (lvm.sp + slots <= lvm.stack_size) {
+        return;
+    }
+    while (lvm.sp + slots > lvm.stack_size) {
+        lvm.stack_size *= 2;
+    }
+    lvm.stack = realloc(lvm.stack, lvm.stack_size * sizeof(struct lval*));
+    assert(lvm.stack);
+}
+
+/* Return the first error of the values, or NULL */
+static struct lval*
+lvm_error(struct lval** values, int n) {
+    for (int i = 0; i < n; ++i) {
+        if (lval_type(values[i]) == LVAL_ERR) {
+            return values[i];
+        }
+    }
+    return NULL;
+}
+
+/* Move the values to a new S-expression */
+static struct lval*
+lvm_sexpr(struct lval** values, int n) {
+    struct lval* a = lval_sexpr();
+    lval_reserve(a, 0, n);
+    a->count = n;
+    for (int i = 0; i < n; ++i) {
+        a->cell[i] = values[i];
+    }
+    return a;
+}
+
+/* Error of a call which would need more than lvm_max_depth frames */
+static struct lval*
+lvm_depth_error(void) {
+    return lval_err("Stack overflow : more than %i nested calls", lvm_max_depth);
+}
+
+/* Return the Q-expression evaluated by LOP_EVAL, given the n arguments of
+ * eval or cond which are consumed. Errors are the ones of the builtins */
+static struct lval*
+lvm_eval_arg(struct lval** args, int n) {
+    static const int cond_types[] = {LVAL_BOOL, LVAL_QEXPR, LVAL_QEXPR};
+    const char* name = (n == 1) ? "eval" : "cond";
+    struct lval* err = lvm_error(args, n);
+    if (err) {
+        lval_ref(err);
+    }
+    for (int i = 0; i < n && !err; ++i) {
+        int type = lval_type(args[i]);
+        int wanted = (n == 1) ? LVAL_QEXPR : cond_types[i];
+        if (type != wanted) {
+            err = lval_err(
+                "%s : Wrong type for argument %i. Got %s, Expected %s.", name,
+                i, ltype_name(type), ltype_name(wanted));
+        }
+    }
+    if (err) {
+        for (int i = 0; i < n; ++i) {
+            lval_del(args[i]);
+        }
+        return err;
+    }
+
+    if (n == 1) {
+        return args[0];
+    }
+    /* The test is a boolean, which is an immediate */
+    bool test = lval_to_bool(args[0]);
+    lval_del(args[test ? 2 : 1]);
+    return args[test ? 1 : 2];
+}
+
+/* Error of builtin_cond for a test which is not a boolean, which is consumed.
+ * An error given as test is returned as is */
+static struct lval*
+lvm_cond_error(struct lval* test) {
+    if (lval_type(test) == LVAL_ERR) {
+        return test;
+    }
+    int type = lval_type(test);
+    lval_del(test);
+    return lval_err("%s : Wrong type for argument %i. Got %s, Expected %s.",
+                    "cond", 0, ltype_name(type), ltype_name(LVAL_BOOL));
+}
+
+/* Value of the formal at position k, bound in the slots of the frame */
+static inline struct lval*
+lvm_local(struct lenv* env, int k) {
+    struct lval* v = env->slots[k];
+    return v ? lval_ref(lval_unbox(v))
+             : lenv_get(env, env->fun->formals->cell[k]);
+}
+
+/* Value at position k of the closure of the lambda of the frame, unless a
+ * name of the frame shadows it or it is not bound yet */
+static inline struct lval*
+lvm_captured(struct lenv* env, int k) {
+    struct lval* f = env->fun;
+    struct lval* v = f->closure->cell[k]->boxed;
+    if (env->table || !v) {
+        return lenv_get(env, f->closure_names->cell[k]);
+    }
+    return lval_ref(v);
+}
+
+/* True for the integers stored as immediates */
+static inline bool
+lvm_is_small_int(struct lval* v) {
+    return (uintptr_t)v < LVAL_NUM_OFFSET &&
+           ((uintptr_t)v & LVAL_TAG_MASK) == LVAL_TAG_INT;
+}
+
+/* Apply a binary builtin to x and y, which are consumed */
+static struct lval*
+lvm_binary(struct lenv* e, int op, struct lval* x, struct lval* y) {
+    if (lval_type(x) == LVAL_ERR) {
+        lval_del(y);
+        return x;
+    }
+    if (lval_type(y) == LVAL_ERR) {
+        lval_del(x);
+        return y;
+    }
+
+    /* Immediate integers have 46 bits : they are added without overflow, and
+     * compared by their encoding, which keeps the order */
+    if (lvm_is_small_int(x) && lvm_is_small_int(y)) {
+        int64_t a = lval_to_int(x);
+        int64_t b = lval_to_int(y);
+        int64_t r;
+        switch (op) {
+            case LOP_ADD:
+                return lval_int(a + b);
+            case LOP_SUB:
+                return lval_int(a - b);
+            case LOP_MUL:
+                if (!__builtin_mul_overflow(a, b, &r)) {
+                    return lval_int(r);
+                }
+                break;
+            case LOP_DIV:
+                if (b != 0 && a % b == 0) {
+                    return lval_int(a / b);
+                }
+                break;
+            case LOP_MOD:
+                if (b != 0) {
+                    return lval_int(a % b);
+                }
+                break;
+            case LOP_EQ:
+                return lval_bool(x == y);
+            case LOP_NE:
+                return lval_bool(x != y);
+            case LOP_GT:
+                return lval_bool((uintptr_t)x > (uintptr_t)y);
+            case LOP_GE:
+                return lval_bool((uintptr_t)x >= (uintptr_t)y);
+            case LOP_LT:
+                return lval_bool((uintptr_t)x < (uintptr_t)y);
+            case LOP_LE:
+                return lval_bool((uintptr_t)x <= (uintptr_t)y);
+        }
+    }
+
+    struct lval* args[] = {x, y};
+    return lvm_binary_builtins[op - LOP_ADD](e, lvm_sexpr(args, 2));
+}
+
+/* Run the frames from the top one until the frame at index first returns.
+ *
+ * The stack and the frames may be reallocated by nested calls (a builtin
+ * can evaluate code, which enters lvm_execute again) : sp is saved in lvm.sp
+ * before them, and every pointer is reloaded after them.
+ *
+ * With GCC, each handler jumps to the next one through a table of labels
+ * (threaded code), so that every opcode has its own indirect branch to
+ * predict. Other compilers dispatch with a switch.
+ */
+static struct lval*
+lvm_execute(int first) {
+    struct lvm_frame* fr;
+    struct lcode* code;
+    struct lval** sp;
+    struct lenv* env;
+    int pc;
+    int op;
+    /* Arguments of the call being made */
+    int n;
+
+#define LVM_SAVE()               \
+    do {                         \
+        lvm.sp = sp - lvm.stack; \
+        fr->pc = pc;             \
+    } while (0)
+#define LVM_LOAD()                             \
+    do {                                       \
+        fr = &lvm.frames[lvm.frame_count - 1]; \
+        code = fr->code;                       \
+        env = fr->env;                         \
+        pc = fr->pc;                           \
+        sp = lvm.stack + lvm.sp;               \
+    } while (0)
+
+/* Continue after the jump targets if test is true, at the first one if it is
+ * false. Other values are replaced by an error, the result of cond */
+#define LVM_BRANCH(test)                   \
+    do {                                   \
+        struct lval* value = (test);       \
+        if (value == LVAL_TRUE) {          \
+            pc += 2;                       \
+        } else if (value == LVAL_FALSE) {  \
+            pc = code->ops[pc];            \
+        } else {                           \
+            *sp++ = lvm_cond_error(value); \
+            pc = code->ops[pc + 1];        \
+        }                                  \
+    } while (0)
+
+#ifdef LVM_THREADED
+    static const void* labels[LOP_COUNT] = {
+        [LOP_CONST] = &&op_CONST,
+        [LOP_LOCAL] = &&op_LOCAL,
+        [LOP_CAPTURED] = &&op_CAPTURED,
+        [LOP_GLOBAL] = &&op_GLOBAL,
+        [LOP_CALL] = &&op_CALL,
+        [LOP_TAIL_CALL] = &&op_TAIL_CALL,
+        [LOP_BUILTIN] = &&op_BUILTIN,
+        [LOP_EVAL] = &&op_EVAL,
+        [LOP_TAIL_EVAL] = &&op_TAIL_EVAL,
+        [LOP_EVAL_HEAD] = &&op_EVAL_HEAD,
+        [LOP_TAIL_EVAL_HEAD] = &&op_TAIL_EVAL_HEAD,
+        [LOP_FOLDED] = &&op_FOLDED,
+        [LOP_JUMP] = &&op_JUMP,
+        [LOP_JUMP_IF_FALSE] = &&op_JUMP_IF_FALSE,
+        [LOP_DROP] = &&op_DROP,
+        [LOP_ADD] = &&op_ADD,
+        [LOP_SUB] = &&op_SUB,
+        [LOP_MUL] = &&op_MUL,
+        [LOP_DIV] = &&op_DIV,
+        [LOP_MOD] = &&op_MOD,
+        [LOP_EQ] = &&op_EQ,
+        [LOP_NE] = &&op_NE,
+        [LOP_GT] = &&op_GT,
+        [LOP_GE] = &&op_GE,
+        [LOP_LT] = &&op_LT,
+        [LOP_LE] = &&op_LE,
+        [LOP_RETURN] = &&op_RETURN,
+        [LOP_BINARY_LOCAL_CONST] = &&op_BINARY_LOCAL_CONST,
+        [LOP_BINARY_JUMP] = &&op_BINARY_JUMP,
+        [LOP_BINARY_LOCAL_CONST_JUMP] = &&op_BINARY_LOCAL_CONST_JUMP,
+    };
+#define LVM_OP(name) op_##name
+#define LVM_NEXT()            \
+    do {                      \
+        op = code->ops[pc++]; \
+        LVM_COUNT_PAIR(op);   \
+        goto* labels[op];     \
+    } while (0)
+#else
+#define LVM_OP(name) case LOP_##name
+#define LVM_NEXT() goto dispatch
+#endif
+
+    LVM_LOAD();
+#ifdef LVM_THREADED
+    LVM_NEXT();
+#else
+dispatch:
+    op = code->ops[pc++];
+    LVM_COUNT_PAIR(op);
+    switch (op) {
+#endif
+
+    LVM_OP(CONST):
+        *sp++ = lval_ref(code->consts[code->ops[pc++]]);
+        LVM_NEXT();
+
+    LVM_OP(LOCAL):
+        *sp++ = lvm_local(env, code->ops[pc++]);
+        LVM_NEXT();
+
+    LVM_OP(CAPTURED):
+        *sp++ = lvm_captured(env, code->ops[pc++]);
+        LVM_NEXT();
+
+    LVM_OP(GLOBAL): {
+        struct lval* sym = code->consts[code->ops[pc]];
+        struct lcode_cache* cache = &code->caches[code->ops[pc + 1]];
+        if (cache->version != lenv_version) {
+            cache->value = lenv_global_value(sym);
+            cache->version = lenv_version;
+        }
+        *sp++ = cache->value ? lval_ref(cache->value) : lenv_get(env, sym);
+        pc += 2;
+        LVM_NEXT();
+    }
+
+    LVM_OP(FOLDED): {
+        /* The value stays valid while none of its names is bound again */
+        int n = code->ops[pc + 2];
+        bool valid = true;
+        for (int i = 0; valid && i < n; ++i) {
+            char* name = lval_to_sym(code->consts[code->ops[pc + 3 + i]]);
+            valid = !(*lsym_flags(name) & (LSYM_LOCAL | LSYM_REDEFINED));
+        }
+        if (valid) {
+            /* An immediate : the reference is not needed */
+            *sp++ = code->consts[code->ops[pc]];
+            pc = code->ops[pc + 1];
+        } else {
+            pc += 3 + n;
+        }
+        LVM_NEXT();
+    }
+
+    LVM_OP(JUMP):
+        pc = code->ops[pc];
+        LVM_NEXT();
+
+    LVM_OP(JUMP_IF_FALSE):
+        LVM_BRANCH(*--sp);
+        LVM_NEXT();
+
+    LVM_OP(DROP):
+        if (lval_type(sp[-1]) == LVAL_ERR) {
+            pc = code->ops[pc];
+        } else {
+            lval_del(*--sp);
+            pc++;
+        }
+        LVM_NEXT();
+
+    LVM_OP(ADD):
+    LVM_OP(SUB):
+    LVM_OP(MUL):
+    LVM_OP(DIV):
+    LVM_OP(MOD):
+    LVM_OP(EQ):
+    LVM_OP(NE):
+    LVM_OP(GT):
+    LVM_OP(GE):
+    LVM_OP(LT):
+    LVM_OP(LE): {
+        struct lval* y = *--sp;
+        struct lval* x = *--sp;
+        *sp++ = lvm_binary(env, op, x, y);
+        LVM_NEXT();
+    }
+
+    LVM_OP(BINARY_LOCAL_CONST): {
+        struct lval* x = lvm_local(env, code->ops[pc + 1]);
+        struct lval* y = lval_ref(code->consts[code->ops[pc + 2]]);
+        *sp++ = lvm_binary(env, code->ops[pc], x, y);
+        pc += 3;
+        LVM_NEXT();
+    }
+
+    LVM_OP(BINARY_JUMP): {
+        struct lval* y = *--sp;
+        struct lval* x = *--sp;
+        struct lval* test = lvm_binary(env, code->ops[pc++], x, y);
+        LVM_BRANCH(test);
+        LVM_NEXT();
+    }
+
+    LVM_OP(BINARY_LOCAL_CONST_JUMP): {
+        struct lval* x = lvm_local(env, code->ops[pc + 1]);
+        struct lval* y = lval_ref(code->consts[code->ops[pc + 2]]);
+        struct lval* test = lvm_binary(env, code->ops[pc], x, y);
+        pc += 3;
+        LVM_BRANCH(test);
+        LVM_NEXT();
+    }
+
+    LVM_OP(BUILTIN): {
+        lbuiltin builtin = code->builtins[code->ops[pc++]];
+        n = code->ops[pc++];
+        sp -= n;
+        struct lval* err = lvm_error(sp, n);
+        struct lval* result;
+        if (err) {
+            lval_ref(err);
+            for (int i = 0; i < n; ++i) {
+                lval_del(sp[i]);
+            }
+            result = err;
+        } else {
+            struct lval* a = lvm_sexpr(sp, n);
+            LVM_SAVE();
+            result = builtin(env, a);
+            LVM_LOAD();
+        }
+        *sp++ = result;
+        LVM_NEXT();
+    }
+
+    LVM_OP(CALL):
+    LVM_OP(TAIL_CALL):
+        n = code->ops[pc++];
+    call: {
+        sp -= n + 1;
+        struct lval* f = sp[0];
+        struct lval** args = sp + 1;
+
+        /* Same checks as lval_eval_cells */
+        struct lval* result = lvm_error(sp, n + 1);
+        if (result) {
+            lval_ref(result);
+            for (int i = 0; i <= n; ++i) {
+                lval_del(sp[i]);
+            }
+            *sp++ = result;
+            goto call_done;
+        }
+        if (lval_type(f) != LVAL_FUN) {
+            for (int i = 0; i <= n; ++i) {
+                lval_del(sp[i]);
+            }
+            *sp++ = lval_err("S-expression does not start with a function !");
+            goto call_done;
+        }
+
+        struct lenv* callee = NULL;
+        if (!f->builtin && f->code && lvm.frame_count >= lvm_max_depth) {
+            for (int i = 0; i <= n; ++i) {
+                lval_del(sp[i]);
+            }
+            *sp++ = lvm_depth_error();
+            goto call_done;
+        }
+        if (!f->builtin && f->code) {
+            /* A tail call binds its arguments in the environment of the
+             * frame, which the callee cannot capture from, unless the
+             * lambdas it created still need it. It is only owned if
+             * envs > 0 */
+            bool reuse = (op == LOP_TAIL_CALL && fr->envs > 0);
+            reuse = reuse && lenv_reusable(env);
+            callee = lval_bind(env, f, args, n, reuse ? env : NULL);
+        }
+        if (callee && op == LOP_TAIL_CALL) {
+            /* The caller is done, but its environment is still a parent of
+             * the callee one, unless it was reused */
+            int envs = (callee == env) ? fr->envs : fr->envs + 1;
+            lval_del(fr->fun);
+            lcode_del(fr->code);
+            fr->fun = f;
+            fr->code = lcode_ref(f->code);
+            fr->pc = 0;
+            fr->env = callee;
+            fr->envs = envs;
+            lvm.sp = fr->base;
+            lvm_reserve(f->code->max_stack);
+            LVM_LOAD();
+            LVM_NEXT();
+        }
+        if (callee) {
+            LVM_SAVE();
+            lvm_push_frame(f, lcode_ref(f->code), callee, 1);
+            LVM_LOAD();
+            LVM_NEXT();
+        }
+
+        /* Builtins, lambdas without code, partial application */
+        struct lval* a = lvm_sexpr(args, n);
+        LVM_SAVE();
+        result = lval_call(env, f, a);
+        LVM_LOAD();
+        lval_del(f);
+        *sp++ = result;
+
+    call_done:
+        if (op == LOP_CALL) {
+            LVM_NEXT();
+        }
+        goto return_value;
+    }
+
+    LVM_OP(EVAL_HEAD):
+    LVM_OP(TAIL_EVAL_HEAD): {
+        int k = code->ops[pc++];
+        struct lval* x = sp[-1];
+        if (lval_type(x) == LVAL_QEXPR && x->count > k &&
+            lval_type(x->cell[k]) != LVAL_SEXPR) {
+            /* Same as eval of a single value, read in place */
+            sp[-1] = lval_eval_borrowed(env, x->cell[k]);
+            lval_del(x);
+            if (op == LOP_EVAL_HEAD) {
+                LVM_NEXT();
+            }
+            goto return_value;
+        }
+
+        /* The lists are made by the builtins, to give the same values and
+         * errors, and evaluated by LOP_EVAL */
+        LVM_SAVE();
+        for (int i = 0; i <= k && lval_type(x) != LVAL_ERR; ++i) {
+            lbuiltin builtin = (i < k) ? builtin_tail : builtin_head;
+            x = builtin(env, lval_add(lval_sexpr(), x));
+        }
+        LVM_LOAD();
+        sp[-1] = x;
+        n = 1;
+        op = (op == LOP_EVAL_HEAD) ? LOP_EVAL : LOP_TAIL_EVAL;
+        goto eval;
+    }
+
+    LVM_OP(EVAL):
+    LVM_OP(TAIL_EVAL):
+        n = code->ops[pc++];
+    eval: {
+        bool tail = (op == LOP_TAIL_EVAL);
+        sp -= n;
+        struct lval* x = lvm_eval_arg(sp, n);
+        struct lval* result = NULL;
+        if (lval_type(x) != LVAL_QEXPR) {
+            result = x;
+        } else if (x->count == 0) {
+            result = lval_unit();
+        } else if (x->count == 1 && lval_type(x->cell[0]) != LVAL_SEXPR) {
+            /* A single value is not called */
+            result = lval_eval_borrowed(env, x->cell[0]);
+        }
+        if (result) {
+            if (x != result) {
+                lval_del(x);
+            }
+            *sp++ = result;
+            if (!tail) {
+                LVM_NEXT();
+            }
+            goto return_value;
+        }
+
+        /* A call whose function and arguments need no evaluation, like the
+         * ones of unpack, is made directly */
+        bool flat = true;
+        for (int i = 0; i < x->count && flat; ++i) {
+            flat = (lval_type(x->cell[i]) != LVAL_SEXPR);
+        }
+        if (flat) {
+            lvm.sp = sp - lvm.stack;
+            lvm_reserve(x->count);
+            sp = lvm.stack + lvm.sp;
+            for (int i = 0; i < x->count; ++i) {
+                *sp++ = lval_eval_borrowed(env, x->cell[i]);
+            }
+            n = x->count - 1;
+            lval_del(x);
+            op = tail ? LOP_TAIL_CALL : LOP_CALL;
+            goto call;
+        }
+
+        if (lvm.frame_count >= lvm_max_depth) {
+            lval_del(x);
+            *sp++ = lvm_depth_error();
+            if (!tail) {
+                LVM_NEXT();
+            }
+            goto return_value;
+        }
+
+        /* The Q-expression is compiled like the body of a lambda without
+         * formals, once, and run in the environment of the frame */
+        struct lcode* compiled = lcode_compile_eval(env, x);
+        if (tail) {
+            lval_del(fr->fun);
+            lcode_del(fr->code);
+            fr->fun = x;
+            fr->code = compiled;
+            fr->pc = 0;
+            lvm.sp = fr->base;
+            lvm_reserve(compiled->max_stack);
+            LVM_LOAD();
+            LVM_NEXT();
+        }
+        LVM_SAVE();
+        lvm_push_frame(x, compiled, env, 0);
+        LVM_LOAD();
+        LVM_NEXT();
+    }
+
+    LVM_OP(RETURN):
+    return_value: {
+        struct lval* result = *--sp;
+        assert(sp == lvm.stack + fr->base);
+
+        struct lenv* it = fr->env;
+        for (int i = 0; i < fr->envs; ++i) {
+            struct lenv* par = it->par;
+            lenv_del(it);
+            it = par;
+        }
+        lval_del(fr->fun);
+        lcode_del(fr->code);
+
+        lvm.frame_count--;
+        lvm.sp = fr->base;
+        if (lvm.frame_count == first) {
+            return result;
+        }
+        LVM_LOAD();
+        *sp++ = result;
+        LVM_NEXT();
+    }
+
+#ifndef LVM_THREADED
+    }
+    /* Every handler ends with LVM_NEXT */
+    assert(false);
+    return NULL;
+#endif
+
+#undef LVM_SAVE
+#undef LVM_LOAD
+#undef LVM_BRANCH
+#undef LVM_OP
+#undef LVM_NEXT
+}
@@ -0,0 +1,54 @@
+#ifndef LVM_H_
+#define LVM_H_
+
+/** Stack based virtual machine running the bytecode of lcode.h
+ *
+ * Calling a lambda does not copy it : its arguments are bound in a new
+ * environment, the frame (see lval_bind), whose parent is the environment of
+ * the caller. Calls between compiled lambdas push a frame on the stack of the
+ * VM instead of recursing in C, and a call in tail position replaces the
+ * frame of the caller. Symbols are not looked up in the environment of the
+ * caller (see lenv.h), so a tail call binds its arguments in place, and
+ * loops run in constant memory, mutually recursive ones included. Only a
+ * caller whose lambdas need the names it bound late is kept until the callee
+ * returns (see lenv_reusable).
+ *
+ * The tree-walking evaluator of lval.c is still used for the code that is not
+ * in a lambda body (the top level, the expressions evaluated by load or by
+ * builtins called indirectly...), and for every lambda when the LISPY_NO_VM
+ * environment variable is set. eval and cond called from a lambda body are
+ * run by the VM, see LOP_EVAL.
+ *
+ * The depth of the evaluation is limited in both cases, and going deeper
+ * gives an error instead of a crash : the VM has at most LISPY_MAX_DEPTH
+ * frames (4194304 by default), and the evaluators that recurse in C stop
+ * before the end of the C stack (see lvm_stack_exhausted).
+ *
+ * The stacks of the VM are thread local, like the pools of lalloc.h.
+ */
+
+#include <stdbool.h>
+
+#include "lval.h"
+
+/* Allocate the stacks of the calling thread, which is near the top of its C
+ * stack, and read LISPY_NO_VM and LISPY_MAX_DEPTH */
+void lvm_init(void);
+
+/* True if new lambdas should be compiled */
+bool lvm_enabled(void);
+
+/* True if the C stack is too full to evaluate one more nested expression */
+bool lvm_stack_exhausted(void);
+
+/* Error returned instead of an evaluation when the C stack is exhausted */
+struct lval* lvm_stack_error(void);
+
+/* Run the code of the lambda f, whose arguments are bound in env, the frame
+ * of the call. env is taken */
+struct lval* lvm_run(struct lval* f, struct lenv* env);
+
+/* Free the stacks of the calling thread */
+void lvm_cleanup(void);
+
+#endif /* LVM_H_ */
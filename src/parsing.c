@@ -5,8 +5,13 @@
 #include <histedit.h>
 
 #include "evaluation.h"
+#include "lalloc.h"
+#include "lcode.h"
 #include "lenv.h"
+#include "lgc.h"
+#include "lsym.h"
 #include "lval.h"
+#include "lvm.h"
 #include "mpc.h"
 
 int
@@ -37,6 +42,15 @@ main(int argc, char* argv[]) {
     puts("Lispy Version 0.0.1.1.0");
     puts("Press Ctrl+C, Ctrl+D, or type \"exit\" in prompt to exit\n");
 
+    lsym_init();
+#ifdef LISPY_GC
+    lgc_init();
+#else
+    lalloc_init(0);
+#endif
+    lval_init();
+    lvm_init();
+    lcode_init();
     struct lenv* e = lenv_new(Lispy);
     lenv_add_builtins(e);
 
@@ -47,7 +61,7 @@ main(int argc, char* argv[]) {
 
             struct lval* x = builtin_load(e, args);
 
-            if (x->type == LVAL_ERR) {
+            if (lval_type(x) == LVAL_ERR) {
                 lval_println(x);
             }
             lval_del(x);
@@ -71,7 +85,7 @@ main(int argc, char* argv[]) {
             struct lval* result = lval_eval(e, lval_read(r.output));
             lval_println(result);
             mpc_ast_delete(r.output);
-            if (result->type == LVAL_EXIT_REQ) {
+            if (lval_type(result) == LVAL_EXIT_REQ) {
                 lval_del(result);
                 break;
             }
@@ -85,6 +99,15 @@ main(int argc, char* argv[]) {
     }
 
     lenv_del(e);
+    lenv_cleanup();
+    lvm_cleanup();
+    lval_cleanup();
+#ifdef LISPY_GC
+    lgc_cleanup();
+#else
+    lalloc_cleanup();
+#endif
+    lsym_cleanup();
 
     mpc_cleanup(8, Number, Symbol, String, Comment, SExpr, QExpr, Expr, Lispy);
     return EXIT_SUCCESS;